@@ -0,0 +1,1047 @@
+/*
+    Caching agent that runs on a client host. Processes that load mylib.so with
+    agent15440 set talk to it over a Unix socket instead of each opening a TCP
+    connection of its own; the agent relays their requests over a few pipelined
+    connections to the server. Positional reads of whole blocks are answered from
+    a chunk cache shared by every process of the host, and identical reads that
+    miss while one is already on its way to the server wait for that one fetch.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include "rpc.h"
+
+#define CHUNKLEN (64*1024)      // the block size of the client's reads
+#define MAXEVENTS 64
+#define FILESLOTS 4096
+#define CHUNKBUCKETS 8192
+
+/// @brief what a peer of the event loop is
+enum {
+    P_LISTEN,
+    P_CLIENT,
+    P_UPSTREAM,
+};
+
+/// @brief where a peer is in receiving its next frame
+enum {
+    S_HDR,      // waiting for the frame header
+    S_BODY,     // waiting for the bytes that follow it
+};
+
+/// @brief bytes queued for a non-blocking socket, buf[start, end) still has to go out
+struct outbuf {
+    char *buf;
+    size_t start;
+    size_t end;
+    size_t cap;
+};
+
+/// @brief one socket of the event loop with its framing state. Clients send
+///         reqHdr frames, upstreams send replyHdr frames
+struct peer {
+    int kind;
+    struct conn c;
+    int state;
+    char hdr[sizeof(struct reqHdr)];
+    size_t hdrLen;
+    size_t got;             // bytes of hdr or body received so far
+    char *body;
+    long long bodyLen;
+    struct outbuf out;
+    int writing;            // EPOLLOUT is armed because out is not empty
+};
+
+/// @brief what the agent knows of a remote fd of a client
+struct remoteFd {
+    char owned;             // opened by this client and not closed
+    char cacheable;         // a regular file opened read-only
+    dev_t dev;
+    ino_t ino;
+};
+
+/// @brief a reply owed to a client. Replies go back in the order the requests came
+///         in, so a cache hit never overtakes the failure of an earlier one-way request
+struct slot {
+    struct client *cl;
+    unsigned id;            // the client's id of the request
+    int ready;
+    char *body;             // reply body, NULL if nothing is sent (a one-way success)
+    long long len;
+    struct slot *next;      // next reply owed to cl
+    struct slot *wnext;     // next slot waiting for the same fetch
+};
+
+/// @brief a process connected to the agent
+struct client {
+    struct peer p;
+    struct upstream *up;    // connection its requests are relayed on
+    struct remoteFd *fds;
+    int nfds;
+    struct slot *head;
+    struct slot *tail;
+    int dead;               // disconnected, kept until no slot refers to it
+    int refs;               // slots not released yet
+};
+
+/// @brief a request relayed to the server. The server answers the requests of a
+///         connection in order, and the agent relays one-way requests as normal
+///         ones, so the n-th reply of an upstream resolves its n-th entry
+struct entry {
+    int op;
+    int flags;              // flags the client sent the request with
+    int oflags;             // open flags of an OP_OPEN
+    struct slot *slot;      // where the reply goes, NULL if nobody waits for it
+    struct fetch *fetch;    // chunk fetch this entry is for
+    int writing;            // an OP_WRITE or OP_PWRITE to the file dev/ino
+    dev_t dev;
+    ino_t ino;
+    struct entry *next;
+};
+
+/// @brief a connection to the server
+struct upstream {
+    struct peer p;
+    struct entry *head;
+    struct entry *tail;
+    int clients;
+};
+
+/// @brief a file whose chunks may be cached. gen changes whenever its contents may
+///         have changed, which invalidates every chunk stored under an older gen
+struct afile {
+    dev_t dev;
+    ino_t ino;
+    int used;
+    long long mtime;        // as of the latest read-only open, -1 if unknown
+    off_t size;
+    unsigned long long gen;
+    int writes;             // writes relayed but not answered yet
+};
+
+/// @brief the reply to a positional read of one block
+struct chunk {
+    dev_t dev;
+    ino_t ino;
+    off_t off;
+    unsigned long long gen;
+    char *body;
+    int len;
+    struct chunk *hnext;
+    struct chunk *prev;     // LRU list, most recently used first
+    struct chunk *next;
+};
+
+/// @brief a block read on its way to the server, and the slots waiting for it
+struct fetch {
+    dev_t dev;
+    ino_t ino;
+    off_t off;
+    unsigned long long gen;
+    int clean;              // no write to the file was in flight when it was sent
+    struct slot *waiters;
+    struct fetch *next;
+};
+
+int epfd = 0;
+struct upstream *ups = NULL;
+int nups = 4;               // connections to the server, from agentconns15440
+int nextUp = 0;
+
+struct afile afiles[FILESLOTS];
+unsigned long long nextGen = 1;
+
+struct chunk *buckets[CHUNKBUCKETS];
+struct chunk *lruHead = NULL;
+struct chunk *lruTail = NULL;
+size_t cacheUsed = 0;
+size_t cacheBudget = 64*1024*1024;  // bytes of chunks kept, from agentcache15440
+
+struct fetch *fetches = NULL;
+
+/// @brief append the n bytes of p to o
+void outAppend(struct outbuf *o, const void *p, size_t n){
+    if (o->end + n > o->cap){
+        if (o->start > 0){
+            memmove(o->buf, o->buf + o->start, o->end - o->start);
+            o->end -= o->start;
+            o->start = 0;
+        }
+        size_t cap = o->cap ? o->cap : 4096;
+        while (cap < o->end + n){
+            cap *= 2;
+        }
+        if (cap != o->cap){
+            char *buf = realloc(o->buf, cap);
+            if (buf == NULL){
+                err(1,0);
+            }
+            o->buf = buf;
+            o->cap = cap;
+        }
+    }
+    memcpy(o->buf + o->end, p, n);
+    o->end += n;
+}
+
+/// @brief (dis)arm EPOLLOUT for p
+void peerArm(struct peer *p, int writing){
+    if (p->writing == writing){
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = p;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, p->c.fd, &ev) < 0){
+        err(1,0);
+    }
+    p->writing = writing;
+}
+
+/// @brief send as much of the output of p as the socket takes without blocking, and
+///         wait for EPOLLOUT if some is left
+/// @return 0 on success, -1 if the peer is gone
+int peerFlush(struct peer *p){
+    struct outbuf *o = &p->out;
+    while (o->start < o->end){
+        ssize_t rv = send(p->c.fd, o->buf + o->start, o->end - o->start, MSG_DONTWAIT|MSG_NOSIGNAL);
+        if (rv < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            o->start = o->end = 0;  //nobody is left to read it
+            return -1;
+        }
+        o->start += rv;
+    }
+    if (o->start == o->end){
+        o->start = o->end = 0;
+    }
+    peerArm(p, o->end > o->start);
+    return 0;
+}
+
+/// @brief advance the framing state machine of p with the bytes that can be received
+///         without blocking
+/// @return 1 if a complete frame is in p->hdr / p->body, 0 if more input is needed,
+///         -1 if the peer closed the connection or sent a malformed frame
+int peerAdvance(struct peer *p){
+    while (1){
+        ssize_t rv;
+        if (p->state == S_HDR){
+            rv = connRecvSome(&p->c, p->hdr + p->got, p->hdrLen - p->got);
+            if (rv <= 0){
+                return (int)rv;
+            }
+            p->got += rv;
+            if (p->got < p->hdrLen){
+                continue;
+            }
+            if (p->kind == P_CLIENT){
+                memcpy(&p->bodyLen, p->hdr + offsetof(struct reqHdr, len), sizeof(p->bodyLen));
+            }else{
+                memcpy(&p->bodyLen, p->hdr + offsetof(struct replyHdr, len), sizeof(p->bodyLen));
+            }
+            if (p->bodyLen < 0){
+                return -1;
+            }
+            if (p->kind == P_CLIENT && p->bodyLen > AGENTMAXLEN + AGENTSLACK){
+                return -1;      //only this client is ended, not the agent every process shares
+            }
+            p->body = malloc(p->bodyLen + 1);
+            if (p->body == NULL){
+                err(1,0);
+            }
+            p->got = 0;
+            p->state = S_BODY;
+        }
+        if (p->got == (size_t)p->bodyLen){
+            p->got = 0;
+            p->state = S_HDR;
+            return 1;
+        }
+        rv = connRecvSome(&p->c, p->body + p->got, p->bodyLen - p->got);
+        if (rv <= 0){
+            return (int)rv;
+        }
+        p->got += rv;
+    }
+}
+
+/// @brief the slot of file dev/ino in the file table
+/// @param create take the slot over if another file holds it
+/// @return the file, NULL if it is not in the table and create is not set
+struct afile *fileFind(dev_t dev, ino_t ino, int create){
+    struct afile *f = &afiles[(dev * 31 + ino) % FILESLOTS];
+    if (f->used && f->dev == dev && f->ino == ino){
+        return f;
+    }
+    if (!create){
+        return NULL;
+    }
+    //a fresh gen, so chunks of an earlier occupant with the same identity never match
+    f->used = 1;
+    f->dev = dev;
+    f->ino = ino;
+    f->mtime = -1;
+    f->size = -1;
+    f->gen = nextGen++;
+    f->writes = 0;
+    return f;
+}
+
+/// @brief the chunk at off of file dev/ino, NULL if it is not cached
+struct chunk **chunkBucket(dev_t dev, ino_t ino, off_t off){
+    return &buckets[(dev * 31 + ino * 17 + off / CHUNKLEN) % CHUNKBUCKETS];
+}
+
+/// @brief remove c from the cache and free it
+void chunkFree(struct chunk *c){
+    struct chunk **pp = chunkBucket(c->dev, c->ino, c->off);
+    while (*pp != c){
+        pp = &(*pp)->hnext;
+    }
+    *pp = c->hnext;
+    if (c->prev){
+        c->prev->next = c->next;
+    }else{
+        lruHead = c->next;
+    }
+    if (c->next){
+        c->next->prev = c->prev;
+    }else{
+        lruTail = c->prev;
+    }
+    cacheUsed -= sizeof(struct chunk) + c->len;
+    free(c->body);
+    free(c);
+}
+
+/// @brief find the current chunk at off of file f; an outdated one is dropped on the way
+/// @return the chunk, moved to the front of the LRU list, NULL on a miss
+struct chunk *chunkFind(struct afile *f, off_t off){
+    struct chunk *c = *chunkBucket(f->dev, f->ino, off);
+    while (c && !(c->dev == f->dev && c->ino == f->ino && c->off == off)){
+        c = c->hnext;
+    }
+    if (c == NULL){
+        return NULL;
+    }
+    if (c->gen != f->gen){
+        chunkFree(c);
+        return NULL;
+    }
+    if (c != lruHead){
+        c->prev->next = c->next;
+        if (c->next){
+            c->next->prev = c->prev;
+        }else{
+            lruTail = c->prev;
+        }
+        c->prev = NULL;
+        c->next = lruHead;
+        lruHead->prev = c;
+        lruHead = c;
+    }
+    return c;
+}
+
+/// @brief cache a copy of the reply body of a block read, evicting the least
+///         recently used chunks to stay within the budget
+void chunkStore(struct fetch *fe, const char *body, int len){
+    size_t need = sizeof(struct chunk) + len;
+    if (need > cacheBudget){
+        return;
+    }
+    struct afile *f = fileFind(fe->dev, fe->ino, 0);
+    if (f == NULL || chunkFind(f, fe->off)){
+        return;
+    }
+    while (cacheUsed + need > cacheBudget && lruTail){
+        chunkFree(lruTail);
+    }
+    struct chunk *c = malloc(sizeof(struct chunk));
+    if (c == NULL){
+        err(1,0);
+    }
+    c->body = malloc(len);
+    if (c->body == NULL){
+        err(1,0);
+    }
+    memcpy(c->body, body, len);
+    c->len = len;
+    c->dev = fe->dev;
+    c->ino = fe->ino;
+    c->off = fe->off;
+    c->gen = fe->gen;
+    struct chunk **b = chunkBucket(c->dev, c->ino, c->off);
+    c->hnext = *b;
+    *b = c;
+    c->prev = NULL;
+    c->next = lruHead;
+    if (lruHead){
+        lruHead->prev = c;
+    }else{
+        lruTail = c;
+    }
+    lruHead = c;
+    cacheUsed += need;
+}
+
+/// @brief the remote fd of cl, growing its table as needed
+struct remoteFd *remoteFdOf(struct client *cl, int fd){
+    if (fd >= cl->nfds){
+        int n = cl->nfds ? cl->nfds : 64;
+        while (n <= fd){
+            n *= 2;
+        }
+        struct remoteFd *fds = realloc(cl->fds, n * sizeof(struct remoteFd));
+        if (fds == NULL){
+            err(1,0);
+        }
+        memset(fds + cl->nfds, 0, (n - cl->nfds) * sizeof(struct remoteFd));
+        cl->fds = fds;
+        cl->nfds = n;
+    }
+    return &cl->fds[fd];
+}
+
+/// @brief the remote fd of cl, NULL unless cl opened fd
+struct remoteFd *fdOwned(struct client *cl, int fd){
+    if (fd < 0 || fd >= cl->nfds || !cl->fds[fd].owned){
+        return NULL;
+    }
+    return &cl->fds[fd];
+}
+
+/// @brief check whether op names one of the session's fds in its first parameter
+int namesFd(int op){
+    return op == OP_CLOSE || op == OP_WRITE || op == OP_READ || op == OP_LSEEK
+        || op == OP_GETDIRENTRIES || op == OP_PREAD || op == OP_PWRITE || op == OP_FSYNC;
+}
+
+/// @brief release cl once it is disconnected and no reply is owed to it any more
+void clientRelease(struct client *cl){
+    if (cl->dead && cl->refs == 0){
+        free(cl->p.out.buf);
+        free(cl);
+    }
+}
+
+/// @brief send the replies owed to cl that are ready, in request order
+void clientFlush(struct client *cl){
+    while (cl->head && cl->head->ready){
+        struct slot *s = cl->head;
+        cl->head = s->next;
+        if (cl->head == NULL){
+            cl->tail = NULL;
+        }
+        if (s->body && !cl->dead){
+            struct replyHdr h;
+            h.len = s->len;
+            h.id = s->id;
+            outAppend(&cl->p.out, &h, sizeof(h));
+            outAppend(&cl->p.out, s->body, s->len);
+        }
+        free(s->body);
+        free(s);
+        cl->refs--;
+    }
+    if (!cl->dead){
+        peerFlush(&cl->p);
+    }
+    clientRelease(cl);
+}
+
+/// @brief reserve the place of the reply to request id of cl
+struct slot *slotNew(struct client *cl, unsigned id){
+    struct slot *s = calloc(1, sizeof(struct slot));
+    if (s == NULL){
+        err(1,0);
+    }
+    s->cl = cl;
+    s->id = id;
+    if (cl->tail){
+        cl->tail->next = s;
+    }else{
+        cl->head = s;
+    }
+    cl->tail = s;
+    cl->refs++;
+    return s;
+}
+
+/// @brief fill s with the reply body (taken over, NULL if nothing is sent) and send
+///         what has become ready
+void slotFill(struct slot *s, char *body, long long len){
+    s->body = body;
+    s->len = len;
+    s->ready = 1;
+    clientFlush(s->cl);
+}
+
+/// @brief relay the frame h, body to the server on u
+void upstreamSend(struct upstream *u, struct reqHdr *h, const char *body){
+    outAppend(&u->p.out, h, sizeof(*h));
+    outAppend(&u->p.out, body, h->len);
+    if (peerFlush(&u->p) < 0){
+        errx(1, "lost the connection to the server");
+    }
+}
+
+/// @brief queue e as the last request u has to answer
+void upstreamQueue(struct upstream *u, struct entry *e){
+    e->next = NULL;
+    if (u->tail){
+        u->tail->next = e;
+    }else{
+        u->head = e;
+    }
+    u->tail = e;
+}
+
+/// @brief close fd of the session of u, for a client that is gone
+void upstreamClose(struct upstream *u, int fd){
+    struct entry *e = calloc(1, sizeof(struct entry));
+    if (e == NULL){
+        err(1,0);
+    }
+    e->op = OP_CLOSE;
+    upstreamQueue(u, e);
+    struct reqHdr h;
+    h.op = OP_CLOSE;
+    h.len = sizeof(int);
+    h.id = 0;
+    h.flags = 0;
+    upstreamSend(u, &h, (char*)&fd);
+}
+
+/// @brief check that the request h, body can be relayed without making the server
+///         end the session, which every client of the upstream shares
+/// @return 1 if it is well formed, 0 otherwise
+int wellFormed(struct reqHdr *h, const char *body, int inCompound){
+    if (h->op == OP_COMPOUND){
+        if (inCompound){
+            return 0;
+        }
+        long long left = h->len;
+        while (left > 0){
+            struct reqHdr sub;
+            if (left < (long long)sizeof(sub)){
+                return 0;
+            }
+            memcpy(&sub, body, sizeof(sub));
+            body += sizeof(sub);
+            left -= sizeof(sub);
+            if (sub.len < 0 || sub.len > left || !wellFormed(&sub, body, 1)){
+                return 0;
+            }
+            body += sub.len;
+            left -= sub.len;
+        }
+        return 1;
+    }
+    if (h->op < OP_OPEN || h->op > OP_ADOPT){
+        return 0;
+    }
+    if (inCompound && (h->op == OP_FORK || h->op == OP_ADOPT)){
+        return 0;   //their replies are only tracked for a request of their own
+    }
+    if (!namesFd(h->op)){
+        return 1;
+    }
+    if (h->len < (int)sizeof(int)){
+        return 0;
+    }
+    //the agent does not learn which fd FD_PREV stands for, so a close of it would leave
+    //the fd owned after the server reuses its number; mylib never sends it
+    int fd;
+    memcpy(&fd, body, sizeof(int));
+    return fd != FD_PREV;
+}
+
+/// @brief check and rewrite request h, body of cl for relaying, and queue the entry
+///         its reply resolves. Like the server, an fd the client does not own is
+///         replaced by -1 so the call fails with EBADF
+/// @return the entry
+struct entry *relayEntry(struct client *cl, struct reqHdr *h, char *body){
+    struct entry *e = calloc(1, sizeof(struct entry));
+    if (e == NULL){
+        err(1,0);
+    }
+    e->op = h->op;
+    e->flags = h->flags;
+    if (namesFd(h->op)){
+        int fd;
+        memcpy(&fd, body, sizeof(int));
+        struct remoteFd *r = fdOwned(cl, fd);
+        if (r == NULL){
+            fd = -1;
+            memcpy(body, &fd, sizeof(int));
+        }else if (r && h->op == OP_CLOSE){
+            r->owned = 0;
+        }else if (r && (h->op == OP_WRITE || h->op == OP_PWRITE)){
+            //chunks cached so far and reads in flight are outdated once the write is served
+            struct afile *f = fileFind(r->dev, r->ino, 1);
+            f->gen = nextGen++;
+            f->writes++;
+            e->writing = 1;
+            e->dev = r->dev;
+            e->ino = r->ino;
+        }
+    }
+    if (h->op == OP_OPEN && h->len >= (int)sizeof(int)){
+        memcpy(&e->oflags, body, sizeof(int));
+    }
+    if (h->op == OP_FORK){
+        //the upstream session is shared, only the client's own fds may go to the ticket
+        for (int off = sizeof(int); off + (int)sizeof(int) <= h->len; off += sizeof(int)){
+            int fd;
+            memcpy(&fd, body + off, sizeof(int));
+            if (fdOwned(cl, fd) == NULL){
+                fd = -1;
+                memcpy(body + off, &fd, sizeof(int));
+            }
+        }
+    }
+    //every relayed request gets a reply, so replies can be matched to entries in order
+    h->flags &= ~RPC_ONEWAY;
+    e->slot = slotNew(cl, h->id);
+    upstreamQueue(cl->up, e);
+    return e;
+}
+
+/// @brief try to answer a positional read of a whole block of a read-only file
+///         from the cache or from a fetch that is already in flight
+/// @return 1 if the read was answered or is waiting, 0 if it has to be relayed
+int cachedPread(struct client *cl, struct reqHdr *h, char *body, struct fetch **fetch){
+    *fetch = NULL;
+    if (h->len != (int)(sizeof(int) + sizeof(size_t) + sizeof(off_t))){
+        return 0;
+    }
+    int fd;
+    size_t n;
+    off_t off;
+    memcpy(&fd, body, sizeof(int));
+    memcpy(&n, body + sizeof(int), sizeof(size_t));
+    memcpy(&off, body + sizeof(int) + sizeof(size_t), sizeof(off_t));
+    struct remoteFd *r = fdOwned(cl, fd);
+    if (r == NULL || !r->cacheable || n != CHUNKLEN || off < 0 || off % CHUNKLEN){
+        return 0;
+    }
+    struct afile *f = fileFind(r->dev, r->ino, 0);
+    if (f == NULL){
+        return 0;
+    }
+    struct chunk *c = chunkFind(f, off);
+    if (c){
+        char *copy = malloc(c->len);
+        if (copy == NULL){
+            err(1,0);
+        }
+        memcpy(copy, c->body, c->len);
+        slotFill(slotNew(cl, h->id), copy, c->len);
+        return 1;
+    }
+    for (struct fetch *fe = fetches; fe; fe = fe->next){
+        if (fe->dev == f->dev && fe->ino == f->ino && fe->off == off && fe->gen == f->gen){
+            struct slot *s = slotNew(cl, h->id);
+            s->wnext = fe->waiters;
+            fe->waiters = s;
+            return 1;
+        }
+    }
+    struct fetch *fe = calloc(1, sizeof(struct fetch));
+    if (fe == NULL){
+        err(1,0);
+    }
+    fe->dev = f->dev;
+    fe->ino = f->ino;
+    fe->off = off;
+    fe->gen = f->gen;
+    fe->clean = f->writes == 0;
+    fe->next = fetches;
+    fetches = fe;
+    *fetch = fe;
+    return 0;
+}
+
+/// @brief handle the request frame h, body of cl
+/// @return 0 on success, -1 if the request was malformed and cl must be disconnected
+int clientRequest(struct client *cl, struct reqHdr *h, char *body){
+    if (!wellFormed(h, body, 0)){
+        return -1;
+    }
+    if (h->op == OP_COMPOUND){
+        char *p = body;
+        long long left = h->len;
+        while (left > 0){
+            struct reqHdr sub;
+            memcpy(&sub, p, sizeof(sub));
+            relayEntry(cl, &sub, p + sizeof(sub));
+            memcpy(p, &sub, sizeof(sub));
+            p += sizeof(sub) + sub.len;
+            left -= sizeof(sub) + sub.len;
+        }
+        upstreamSend(cl->up, h, body);
+        return 0;
+    }
+    struct fetch *fe = NULL;
+    if (h->op == OP_PREAD && cachedPread(cl, h, body, &fe)){
+        return 0;
+    }
+    struct entry *e = relayEntry(cl, h, body);
+    if (fe){
+        e->fetch = fe;
+        fe->waiters = e->slot;
+    }
+    upstreamSend(cl->up, h, body);
+    return 0;
+}
+
+/// @brief record the fd returned by an open of e for its client and, for an RPC_INLINE
+///         open, the identity of the file. A read-only open that finds the file changed
+///         since the last one invalidates its chunks, as does any open for writing
+void openDone(struct upstream *u, struct entry *e, char *body, long long len){
+    int res;
+    if (len < (int)sizeof(int)){
+        return;
+    }
+    memcpy(&res, body, sizeof(int));
+    if (res < 0){
+        return;
+    }
+    if (e->slot->cl->dead){
+        upstreamClose(u, res);
+        return;
+    }
+    struct remoteFd *r = remoteFdOf(e->slot->cl, res);
+    memset(r, 0, sizeof(*r));
+    r->owned = 1;
+    size_t fields = sizeof(int)*2 + sizeof(off_t) + sizeof(dev_t) + sizeof(ino_t) + sizeof(long long);
+    if (!(e->flags & RPC_INLINE) || len < (int)fields){
+        return;
+    }
+    off_t size;
+    long long mtime;
+    char *p = body + sizeof(int)*2;
+    memcpy(&size, p, sizeof(off_t));
+    memcpy(&r->dev, p + sizeof(off_t), sizeof(dev_t));
+    memcpy(&r->ino, p + sizeof(off_t) + sizeof(dev_t), sizeof(ino_t));
+    memcpy(&mtime, p + sizeof(off_t) + sizeof(dev_t) + sizeof(ino_t), sizeof(long long));
+    struct afile *f = fileFind(r->dev, r->ino, 1);
+    if (size >= 0 && (e->oflags & O_ACCMODE) == O_RDONLY){
+        r->cacheable = 1;
+        if (f->mtime != mtime || f->size != size){
+            f->gen = nextGen++;
+            f->mtime = mtime;
+            f->size = size;
+        }
+    }else if ((e->oflags & O_ACCMODE) != O_RDONLY){
+        f->gen = nextGen++;     //e.g. O_TRUNC, or writes to come
+        f->mtime = -1;
+    }
+}
+
+/// @brief record the fds an OP_ADOPT of e took over for its client, or close them
+///         if the client is gone
+void adoptDone(struct upstream *u, struct entry *e, char *body, long long len){
+    int res;
+    if (len < (int)sizeof(int)){
+        return;
+    }
+    memcpy(&res, body, sizeof(int));
+    for (int i = 0; i < res && (int)(sizeof(int)*(4 + 2*i)) <= len; i++){
+        int fd;
+        memcpy(&fd, body + sizeof(int)*(3 + 2*i), sizeof(int));
+        if (e->slot->cl->dead){
+            upstreamClose(u, fd);
+            continue;
+        }
+        struct remoteFd *r = remoteFdOf(e->slot->cl, fd);
+        memset(r, 0, sizeof(*r));
+        r->owned = 1;
+    }
+}
+
+/// @brief hand the reply body of a block read to every slot waiting for it and cache
+///         it unless the file changed while it was in flight
+void fetchDone(struct fetch *fe, char *body, long long len){
+    struct fetch **pp = &fetches;
+    while (*pp != fe){
+        pp = &(*pp)->next;
+    }
+    *pp = fe->next;
+    ssize_t res = -1;
+    if (len >= (int)sizeof(ssize_t)){
+        memcpy(&res, body, sizeof(ssize_t));
+    }
+    struct afile *f = fileFind(fe->dev, fe->ino, 0);
+    if (res >= 0 && fe->clean && f && f->gen == fe->gen){
+        chunkStore(fe, body, len);
+    }
+    struct slot *s = fe->waiters;
+    free(fe);
+    while (s){
+        struct slot *next = s->wnext;
+        char *copy = body;
+        if (next){
+            copy = malloc(len);
+            if (copy == NULL){
+                err(1,0);
+            }
+            memcpy(copy, body, len);
+        }
+        slotFill(s, copy, len);
+        s = next;
+    }
+}
+
+/// @brief check whether the reply body of an op failed: its result comes first
+int replyFailed(int op, const char *body, long long len){
+    if (op == OP_WRITE || op == OP_PWRITE || op == OP_READ || op == OP_PREAD || op == OP_GETDIRENTRIES
+        || op == OP_LSEEK){
+        ssize_t res = -1;
+        if (len >= (int)sizeof(ssize_t)){
+            memcpy(&res, body, sizeof(ssize_t));
+        }
+        return res < 0;
+    }
+    int res = -1;
+    if (len >= (int)sizeof(int)){
+        memcpy(&res, body, sizeof(int));
+    }
+    return res < 0;
+}
+
+/// @brief resolve the oldest entry of u with the reply h, body (taken over)
+void upstreamReply(struct upstream *u, struct replyHdr *h, char *body){
+    struct entry *e = u->head;
+    if (e == NULL){
+        errx(1, "unexpected reply %u from the server", h->id);
+    }
+    u->head = e->next;
+    if (u->head == NULL){
+        u->tail = NULL;
+    }
+    if (e->op == OP_OPEN && e->slot){
+        openDone(u, e, body, h->len);
+    }else if (e->op == OP_ADOPT && e->slot){
+        adoptDone(u, e, body, h->len);
+    }
+    if (e->writing){
+        struct afile *f = fileFind(e->dev, e->ino, 0);
+        if (f && f->writes > 0){
+            f->writes--;
+        }
+    }
+    if (e->fetch){
+        fetchDone(e->fetch, body, h->len);
+    }else if (e->slot && (e->flags & RPC_ONEWAY) && !replyFailed(e->op, body, h->len)){
+        free(body);
+        slotFill(e->slot, NULL, 0);     //the client only hears of one-way requests that failed
+    }else if (e->slot){
+        slotFill(e->slot, body, h->len);
+    }else{
+        free(body);
+    }
+    free(e);
+}
+
+/// @brief register p with the event loop
+void peerAdd(struct peer *p, int kind, int fd){
+    p->kind = kind;
+    p->state = S_HDR;
+    p->hdrLen = kind == P_CLIENT ? sizeof(struct reqHdr) : sizeof(struct replyHdr);
+    connInit(&p->c, fd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+        err(1,0);
+    }
+}
+
+/// @brief disconnect cl: the fds it left open are closed on the server, and cl
+///         itself is released once nothing refers to it any more
+void clientEnd(struct client *cl){
+    epoll_ctl(epfd, EPOLL_CTL_DEL, cl->p.c.fd, NULL);
+    close(cl->p.c.fd);
+    connFree(&cl->p.c);
+    free(cl->p.body);
+    for (int fd = 0; fd < cl->nfds; fd++){
+        if (cl->fds[fd].owned){
+            upstreamClose(cl->up, fd);
+        }
+    }
+    free(cl->fds);
+    cl->up->clients--;
+    cl->dead = 1;
+    clientRelease(cl);
+}
+
+/// @brief accept every pending process on the listening socket, spreading them
+///         over the upstream connections
+void acceptAll(struct peer *l){
+    while (1){
+        int fd = accept4(l->c.fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED
+                || errno == EMFILE || errno == ENFILE){
+                return;
+            }
+            err(1,0);
+        }
+        struct client *cl = calloc(1, sizeof(struct client));
+        if (cl == NULL){
+            err(1,0);
+        }
+        //the least loaded connection, so that one busy client does not delay many
+        struct upstream *u = &ups[nextUp];
+        for (int i = 0; i < nups; i++){
+            if (ups[i].clients < u->clients){
+                u = &ups[i];
+            }
+        }
+        nextUp = (nextUp + 1) % nups;
+        cl->up = u;
+        u->clients++;
+        peerAdd(&cl->p, P_CLIENT, fd);
+    }
+}
+
+/// @brief receive and handle every frame p has ready
+void peerInput(struct peer *p){
+    int rv;
+    while ((rv = peerAdvance(p)) == 1){
+        char *body = p->body;
+        p->body = NULL;
+        if (p->kind == P_UPSTREAM){
+            struct replyHdr h;
+            memcpy(&h, p->hdr, sizeof(h));
+            upstreamReply((struct upstream*)p, &h, body);
+            continue;
+        }
+        struct reqHdr h;
+        memcpy(&h, p->hdr, sizeof(h));
+        rv = clientRequest((struct client*)p, &h, body);
+        free(body);
+        if (rv < 0){
+            break;
+        }
+    }
+    if (rv < 0){
+        if (p->kind == P_UPSTREAM){
+            errx(1, "lost the connection to the server");
+        }
+        clientEnd((struct client*)p);
+    }
+}
+
+/// @brief connect to the server at ip:port
+/// @return the connected socket
+int serverConnect(const char *ip, unsigned short port){
+    struct sockaddr_in srv;
+    int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd < 0){
+        err(1,0);
+    }
+    memset(&srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_addr.s_addr = inet_addr(ip);
+    srv.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr*)&srv, sizeof(srv)) < 0){
+        err(1,0);
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    // the server, as for the client library
+    char *serverip = getenv("server15440");
+    if (!serverip) serverip = "127.0.0.1";
+    char *serverport = getenv("serverport15440");
+    unsigned short port = serverport ? (unsigned short)atoi(serverport) : 15400;
+    // the socket processes reach the agent at
+    char *path = getenv("agent15440");
+    if (!path || !*path) path = "/tmp/agent15440";
+    // connections to the server and memory for cached chunks
+    char *conns = getenv("agentconns15440");
+    if (conns && atoi(conns) > 0) nups = atoi(conns);
+    char *cb = getenv("agentcache15440");
+    if (cb) cacheBudget = strtoul(cb, NULL, 10);
+
+    // a client that disconnects mid-reply must not take the agent down
+    signal(SIGPIPE, SIG_IGN);
+
+    epfd = epoll_create1(0);
+    if (epfd<0) err(1,0);
+
+    ups = calloc(nups, sizeof(struct upstream));
+    if (ups == NULL) err(1,0);
+    for (int i = 0; i < nups; i++) {
+        peerAdd(&ups[i].p, P_UPSTREAM, serverConnect(serverip, port));
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) errx(1, "socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+    int lfd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (lfd<0) err(1,0);
+    unlink(path);   // left behind by an earlier agent
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) err(1,0);
+    if (listen(lfd, SOMAXCONN) < 0) err(1,0);
+    struct peer listener;
+    memset(&listener, 0, sizeof(listener));
+    listener.kind = P_LISTEN;
+    listener.c.fd = lfd;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) < 0) err(1,0);
+
+    // main loop: relay requests and replies as sockets become readable, and send
+    // queued output as they become writable
+    struct epoll_event events[MAXEVENTS];
+    while (1) {
+        int n = epoll_wait(epfd, events, MAXEVENTS, -1);
+        if (n<0) {
+            if (errno == EINTR) continue;
+            err(1,0);
+        }
+        for (int i = 0; i < n; i++) {
+            struct peer *p = events[i].data.ptr;
+            if (p->kind == P_LISTEN) {
+                acceptAll(p);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && peerFlush(p) < 0 && p->kind == P_UPSTREAM) {
+                errx(1, "lost the connection to the server");
+            }
+            if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+                peerInput(p);
+            }
+        }
+    }
+    return 0;
+}
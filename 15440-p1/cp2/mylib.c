@@ -22,15 +22,281 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <err.h>
 #include <errno.h>
 #include "../include/dirtree.h"
+#include "rpc.h"
 
-#define MAXMSGLEN 200
-#define fdOffset 20000
+#define FDCHUNK 1024
+#define FDCHUNKS 1024
+#define MAXPENDING 256
+#define BATCHLEN 8192
+#define BLOCKLEN (64*1024)
+#define NBUCKETS 1024
+#define MAXWINDOW 16
+#define MAXREADAHEAD 64
+#define ATTRBUCKETS 1024
+#define MAXATTRS 8192
+#define COPYLEN (1024*1024)
+#define INDEXSLOTS 4096
+#define INDEXMAGIC 0x15440c01
+#define CHECKSLOTS 1024
+#define FETCHING (~0u)
+#define MAXSTRIPES 16
 
-int sockfd = 0;
+int sockfd = -1;
+struct conn conn;	// buffered receive side of sockfd
+
+/// @brief state of the connection, which is only set up once a request has to go out
+enum{
+	C_NONE,		// not connected yet
+	C_PENDING,	// a non-blocking connect was started by _init (earlyconnect15440)
+	C_UP,
+};
+int connState = C_NONE;
+struct sockaddr_in srvAddr;	// the server, from server15440 and serverport15440
+char *agentPath = NULL;		// socket of the caching agent, from agent15440
+unsigned nextId = 1;	// id of the next request sent on the connection
+unsigned syncedId = 0;	// every request up to this id has completed
+
+/*
+	Threads share the one connection. All client state below is guarded by clientMutex,
+	which is only let go while a thread is blocked on the socket, so the round trips of
+	several threads overlap. One thread at a time sends, and one at a time owns the
+	receive side: the owner reads the next reply header and either keeps the reply
+	(its own, or a readahead or one-way failure it consumes) or hands the reply, with
+	the receive side, to the thread that registered a waiter for its id. That thread
+	receives the payload straight into its caller's buffer, and gives the receive side
+	up once the payload is consumed
+*/
+pthread_mutex_t clientMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t progress = PTHREAD_COND_INITIALIZER;	// a reply was routed or a side of the connection was freed
+int sending = 0;		// a thread is sending, with clientMutex let go
+int receiving = 0;		// a thread owns the receive side
+__thread int recvOwner = 0;	// this thread is the one that owns the receive side
+unsigned registeredId = 0;	// the replies of every request up to this id can be routed
+
+/// @brief a thread waiting for the reply of request id
+struct waiter{
+	unsigned id;
+	int ready;			// the reply arrived and the receive side was handed over
+	struct replyHdr h;	// its header, once ready
+	struct waiter *next;
+};
+struct waiter *waiters = NULL;
+
+int exiting = 0;	// a fatal error is ending the process
+/// @brief end the process on an error the client cannot recover from, reporting errno.
+/// 	   The calling thread may hold clientMutex and the connection may be what broke,
+/// 	   so _fini leaves the client state alone once this ran
+void fatal(void){
+	__atomic_store_n(&exiting, 1, __ATOMIC_RELEASE);
+	err(1,0);
+}
+
+/*
+	A forked child gets a connection of its own, made by its first request like any
+	other. Before the fork, the parent hands its remote fds to the server under a ticket
+	(OP_FORK); the child adopts them into its own session (OP_ADOPT) when it first works
+	on the server, before anything else goes out, and its placeholders are rebound to
+	the fds of its session. Both processes then have independent streams to the server.
+	Offsets the client tracks are no longer shared between the two, those the server
+	keeps are, as the adopted fds are duplicates of the parent's
+*/
+enum{
+	ADOPT_NONE,
+	ADOPT_PENDING,	// inherited placeholders still stand for fds of the parent's session
+	ADOPT_RUNNING,	// a thread is adopting them, the others wait
+};
+int adoptState = ADOPT_NONE;
+unsigned long long forkTicket = 0;	// from the OP_FORK sent before the fork, 0 if there was none
+void adoptInherited(void);
+
+/// @brief ops that may be sent one-way (bit OP_x), set from oneway15440
+int onewayOps = (1 << OP_CLOSE) | (1 << OP_WRITE) | (1 << OP_PWRITE);
+
+/// @brief a one-way request whose failure reply may still arrive
+struct pending{
+	unsigned id;
+	int fd;		// remote fd a failure is reported on, -1 if none
+};
+
+/// @brief one-way requests in the order they were sent. The server answers requests
+/// 	   in order and only replies to one-way requests that failed, so any reply
+/// 	   resolves all older pending entries
+struct pending pend[MAXPENDING];
+int pendHead = 0;
+int pendCnt = 0;
+
+/// @brief marshalled requests (reqHdr + parameters) held back to travel in one
+/// 	   compound with the next request that is sent
+char batch[BATCHLEN];
+int batchLen = 0;
+
+/// @brief most bytes of a file sent back inline with a read-only open, from inline15440
+size_t inlineLen = 64*1024;
+
+/// @brief client side state of a remote fd, indexed by the server's fd
+struct rfile{
+	int err;		// deferred error of a one-way request, reported on the next call
+	unsigned lastOneway;	// id of the latest one-way request on this fd, 0 if none
+	dev_t dev;		// identity of the open file
+	ino_t ino;
+	int tracked;	// regular file without O_APPEND: reads and writes carry pos,
+					// the server's offset of the fd is not used
+	int cached;		// tracked and read-only: reads go through the block cache
+	off_t pos;
+	off_t size;		// size of the file when it was opened
+	char *pre;		// head of the file returned inline by the open
+	size_t preLen;
+	int preEof;		// pre ends at the end of the file
+	off_t next;		// where the latest read ended, to detect sequential access
+	int window;		// blocks read ahead of the application, 0 after a seek
+	char *wb;		// write-behind buffer, writeBehind bytes once allocated
+	size_t wbLen;	// bytes written by the application but not sent yet
+	off_t wbOff;	// where they go, for a tracked fd
+	char *path;		// canonical path of an fd opened for writing, NULL otherwise
+};
+
+/// @brief a cached stat() result, positive or ENOENT
+struct attr{
+	char *path;		// canonical path
+	int res;
+	int err;
+	struct stat st;
+	struct timespec expires;
+	struct attr *next;
+};
+
+/// @brief the attribute cache: stat results are reused for attrTtl milliseconds
+/// 	   (from attrttl15440), unless this process changes the file meanwhile
+long attrTtl = 1000;
+struct attr *attrs[ATTRBUCKETS];
+int nattrs = 0;
+
+/// @brief whole-file cache directory (cachedir15440), NULL when whole-file caching is
+/// 	   off. It holds one file per cached copy, named <path hash>-<version hash>,
+/// 	   and the index of the copies shared by every process using the directory
+char *cacheDir = NULL;
+long long cacheLimit = 64LL*1024*1024;	// most bytes of copies kept, from cachelimit15440
+int privSeq = 0;
+
+/// @brief the cached copy of one path. A path owns the slot its hash maps to
+struct indexSlot{
+	unsigned long long hash;	// path hash, 0 if the slot is free
+	struct fileVersion v;
+	long long lastUse;			// CLOCK_REALTIME nanoseconds, for LRU eviction
+};
+
+/// @brief layout of the index file, mapped shared by every process of the host.
+/// 	   Writers hold flock on the file and keep seq odd while they change it;
+/// 	   readers take no lock and retry when seq was odd or changed under them
+struct cacheIndex{
+	unsigned magic;
+	unsigned seq;
+	long long total;			// bytes of all copies
+	struct indexSlot slot[INDEXSLOTS];
+};
+
+struct cacheIndex *idx = NULL;
+int idxFd = -1;
+
+/// @brief versions this process has validated with the server, trusted for attrTtl
+struct checked{
+	unsigned long long hash;
+	struct fileVersion v;
+	struct timespec expires;
+};
+
+struct checked checks[CHECKSLOTS];
+
+/// @brief a local fd the application got on a whole-file copy, indexed by the fd
+struct cfile{
+	char *path;		// path on the server, NULL if the fd is not on a copy
+	char *priv;		// private copy a writable fd works on, uploaded by close; NULL for readers
+	mode_t mode;	// mode of a file created by the open
+	int dirty;		// the private copy was written to
+};
+
+struct cfile *cfiles[FDCHUNKS];	// in chunks of FDCHUNK that are never moved, like the rfile table
+int ncfiles = 0;
+
+/// @brief a cached BLOCKLEN sized piece of a remote file
+struct block{
+	int fd;			// server's fd, -1 once the fd was closed during readahead
+	off_t no;		// position in the file, in blocks
+	unsigned id;	// id of the readahead request filling it, FETCHING while a thread
+					// reads it on demand or is sending its readahead, 0 once filled
+	size_t len;		// bytes of the file in data, short at the end of the file
+	int err;		// the readahead failed
+	struct block *prev, *next;	// LRU list, most recently used first
+	struct block *hnext;		// hash chain
+	char data[BLOCKLEN];
+};
+
+/// @brief size of the per-fd write-behind buffers, from writebehind15440. Like one-way
+/// 	   writes they defer errors, so they are only used when writes may be one-way
+size_t writeBehind = 64*1024;
+int wbFiles = 0;	// fds with unsent writes
+
+/// @brief extra connections to the server that large positional reads and writes are
+/// 	   striped over, in ranges of stripeLen bytes (stripes15440, stripelen15440).
+/// 	   Each one joins the group of the main connection, so it may use every remote fd
+struct stripe{
+	struct conn c;
+	int up;			// connected and in the group
+	int busy;		// a thread is transferring on it, with clientMutex let go
+};
+struct stripe stripes[MAXSTRIPES];
+int nstripes = 4;
+size_t stripeLen = 1024*1024;
+unsigned long long groupKey = 0;	// key of the main connection's group, 0 until asked for
+int viaAgent = 0;	// the main connection is to the agent, whose fds stripes cannot share
+
+/// @brief progress of one stripe connection through its ranges of a striped transfer:
+/// 	   leg k of m carries ranges k, k+m, k+2m, ...
+struct leg{
+	struct stripe *s;
+	int cnt;		// ranges of the leg
+	int sent;		// ranges whose request went out entirely
+	int recvd;		// ranges whose reply was consumed
+	int failed;
+	struct reqHdr h;	// request of range sent, while it goes out
+	char fields[sizeof(int) + sizeof(size_t) + sizeof(off_t)];
+	struct iovec *out;	// what is left of it
+	int outCnt;
+	char hdr[sizeof(struct replyHdr) + sizeof(ssize_t) + sizeof(int)];	// reply of range recvd
+	size_t hdrGot;
+	size_t got;		// bytes of its payload received
+};
+
+/// @brief the block cache, bounded by cacheBudget bytes (from cache15440)
+size_t cacheBudget = 8*1024*1024;
+size_t cacheUsed = 0;
+struct block *buckets[NBUCKETS];
+struct block *lruHead = NULL;
+struct block *lruTail = NULL;
+
+/// @brief outstanding readahead requests in the order they were sent, which is
+/// 	   the order their replies arrive in
+struct block *ahead[MAXREADAHEAD];
+int aheadHead = 0;
+int aheadCnt = 0;
+
+/// @brief client side state of the remote fds, in chunks of FDCHUNK that are never
+/// 	   moved, so a thread keeps its rfile while others open files
+struct rfile *files[FDCHUNKS];
+int nfiles = 0;		// entries in the chunks allocated so far
 
 
 // The following line declares function pointers with the same prototype as the original function calls
@@ -43,6 +309,20 @@ ssize_t (*orig_read)(int fildes, void *buf, size_t nbyte);
 
 ssize_t (*orig_write)(int fildes, const void *buf, size_t nbyte);
 
+ssize_t (*orig_pread)(int fildes, void *buf, size_t nbyte, off_t offset);
+
+ssize_t (*orig_pwrite)(int fildes, const void *buf, size_t nbyte, off_t offset);
+
+ssize_t (*orig_readv)(int fildes, const struct iovec *iov, int iovcnt);
+
+ssize_t (*orig_writev)(int fildes, const struct iovec *iov, int iovcnt);
+
+ssize_t (*orig_preadv)(int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+
+ssize_t (*orig_pwritev)(int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+
+int (*orig_fsync)(int fd);
+
 off_t (*orig_lseek)(int fd, off_t offset, int whence);
 
 int (*orig_stat)(const char *restrict path, struct stat *restrict buf);
@@ -55,56 +335,2226 @@ struct dirtreenode* (*orig_getdirtree)( const char *path );
 
 void (*orig_freedirtree)( struct dirtreenode* dt );
 
-/// @brief send the message arg of length arglen to the server and receive the result of execution
-/// @param arg message to be sent to the server
-/// @param arglen length of the message
-/// @return the response from the server after execution
-char* sendToServer(char* arg, int arglen){
+/// @brief take clientMutex on entry to an interposed call that works on the server.
+/// 	   In a forked child, the first one adopts the inherited fds first
+void clientLock(void){
+	pthread_mutex_lock(&clientMutex);
+	while (adoptState != ADOPT_NONE){
+		if (adoptState == ADOPT_PENDING){
+			__atomic_store_n(&adoptState, ADOPT_RUNNING, __ATOMIC_RELEASE);
+			adoptInherited();
+			__atomic_store_n(&adoptState, ADOPT_NONE, __ATOMIC_RELEASE);
+			pthread_cond_broadcast(&progress);
+		}else{
+			pthread_cond_wait(&progress, &clientMutex);
+		}
+	}
+}
+
+/// @brief give up the receive side if this thread owns it. The reply it received
+/// 	   last must have been consumed
+void recvDone(void){
+	if (recvOwner){
+		recvOwner = 0;
+		receiving = 0;
+		pthread_cond_broadcast(&progress);
+	}
+}
+
+/// @brief leave an interposed call, keeping its errno
+void clientUnlock(void){
+	int error = errno;
+	recvDone();
+	pthread_mutex_unlock(&clientMutex);
+	errno = error;
+}
+
+/// @brief remote fd behind each local placeholder fd, stored +1 so that 0 marks a
+/// 	   local fd. Chunks of the table are installed once and never moved or freed,
+/// 	   so a lookup takes no lock even while other threads open files
+int *fdMap[FDCHUNKS];
+int nullFd = -1;	// /dev/null, duplicated to reserve placeholder fds
+
+/// @brief the remote fd local fd stands for
+/// @return the server's fd, -1 if fd is a local fd
+int remoteFd(int fd){
+	if (fd < 0 || fd >= FDCHUNK*FDCHUNKS){
+		return -1;
+	}
+	int *c = __atomic_load_n(&fdMap[fd / FDCHUNK], __ATOMIC_ACQUIRE);
+	if (c == NULL){
+		return -1;
+	}
+	int remote = __atomic_load_n(&c[fd % FDCHUNK], __ATOMIC_ACQUIRE) - 1;
+	if (remote >= 0 && __atomic_load_n(&adoptState, __ATOMIC_ACQUIRE) != ADOPT_NONE){
+		clientLock();	//an inherited fd: its number in our own session is only known once adopted
+		clientUnlock();
+		return remoteFd(fd);
+	}
+	return remote;
+}
+
+/// @brief reserve a local fd to stand for a remote fd: a close-on-exec duplicate
+/// 	   of /dev/null, so the number is never handed out for anything else meanwhile
+/// @return the placeholder fd, -1 with errno set on failure
+int placeholderNew(void){
+	if (nullFd < 0){
+		int fd = orig_open("/dev/null", O_RDWR|O_CLOEXEC);
+		if (fd < 0){
+			return -1;
+		}
+		int expected = -1;
+		if (!__atomic_compare_exchange_n(&nullFd, &expected, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			orig_close(fd);	//another thread was first
+		}
+	}
+	int fd = fcntl(nullFd, F_DUPFD_CLOEXEC, 0);
+	if (fd >= FDCHUNK*FDCHUNKS){
+		orig_close(fd);
+		errno = EMFILE;
+		return -1;
+	}
+	return fd;
+}
+
+/// @brief make placeholder fd stand for remote fd (-1 makes it local again)
+void fdBind(int fd, int remote){
+	int **slot = &fdMap[fd / FDCHUNK];
+	int *c = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (c == NULL){
+		int *fresh = calloc(FDCHUNK, sizeof(int));
+		if (fresh == NULL){
+			fatal();
+		}
+		if (__atomic_compare_exchange_n(slot, &c, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			c = fresh;
+		}else{
+			free(fresh);	//c is the chunk another thread installed
+		}
+	}
+	__atomic_store_n(&c[fd % FDCHUNK], remote + 1, __ATOMIC_RELEASE);
+}
+
+/// @brief look up the client side state of remote fd, growing the table as needed
+/// @param fd the server's fd
+/// @return state of fd
+struct rfile *fileOf(int fd){
+	if (fd >= FDCHUNK*FDCHUNKS){
+		errno = EBADF;
+		fatal();
+	}
+	while (fd >= nfiles){
+		if ((files[nfiles / FDCHUNK] = calloc(FDCHUNK, sizeof(struct rfile))) == NULL){
+			fatal();
+		}
+		nfiles += FDCHUNK;
+	}
+	return &files[fd / FDCHUNK][fd % FDCHUNK];
+}
+
+/// @brief report a deferred error of fd, if there is one
+/// @param fd the server's fd
+/// @return -1 with errno set if a one-way request on fd failed, 0 otherwise
+int takeError(int fd){
+	struct rfile *f = fileOf(fd);
+	if (f->err){
+		errno = f->err;
+		f->err = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/// @brief normalize path lexically: repeated and trailing slashes, "." and "dir/.."
+/// 	   components are removed, so that spellings of the same path share a cache entry
+/// @param path the path as given by the application
+/// @return the canonical path, malloc'd
+char *canonicalPath(const char *path){
+	size_t n = strlen(path);
+	char *out = malloc(n + 2);
+	if (out == NULL){
+		fatal();
+	}
+	size_t len = 0;
+	size_t root = 0;	// the part of out that ".." must not remove
+	if (path[0] == '/'){
+		out[len++] = '/';
+		root = 1;
+	}
+	const char *p = path;
+	while (*p){
+		while (*p == '/'){
+			p++;
+		}
+		const char *e = p;
+		while (*e && *e != '/'){
+			e++;
+		}
+		size_t c = e - p;
+		int dotdot = c == 2 && p[0] == '.' && p[1] == '.';
+		int lastIsDotdot = len - root >= 2 && out[len-1] == '.' && out[len-2] == '.'
+			&& (len - root == 2 || out[len-3] == '/');
+		if (c == 0 || (c == 1 && p[0] == '.') || (dotdot && root && len == root)){
+			//nothing to add, "/.." is "/"
+		}else if (dotdot && len > root && !lastIsDotdot){
+			while (len > root && out[len-1] != '/'){	//drop the last component
+				len--;
+			}
+			if (len > root){
+				len--;
+			}
+		}else{
+			if (len > root){
+				out[len++] = '/';
+			}
+			memcpy(out+len, p, c);
+			len += c;
+		}
+		p = e;
+	}
+	if (len == 0){
+		out[len++] = '.';
+	}
+	out[len] = '\0';
+	return out;
+}
+
+/// @brief a node of the routing trie: one path component below its parent
+struct route{
+	char *name;
+	int remote;				// paths at or below this node go to the server
+	struct route *child;
+	struct route *sibling;
+};
+
+/// @brief roots of the routing trie for absolute and relative paths, built from
+/// 	   remote15440. Without it every path is remote
+struct route absRoutes;
+struct route relRoutes;
+int routing = 0;
+
+/// @brief find the child of n named by the c bytes at p
+/// @param create add the child if it is missing
+/// @return the child, NULL if it is missing and create is not set
+struct route *routeChild(struct route *n, const char *p, size_t c, int create){
+	for (struct route *r = n->child; r; r = r->sibling){
+		if (strlen(r->name) == c && memcmp(r->name, p, c) == 0){
+			return r;
+		}
+	}
+	if (!create){
+		return NULL;
+	}
+	struct route *r = calloc(1, sizeof(struct route));
+	if (r == NULL || (r->name = strndup(p, c)) == NULL){
+		fatal();
+	}
+	r->sibling = n->child;
+	n->child = r;
+	return r;
+}
+
+/// @brief walk canonical path key down the routing trie
+/// @param create add the nodes that are missing and mark the last one remote
+/// @return 1 if key is at or below a remote prefix, 0 otherwise
+int routeWalk(const char *key, int create){
+	struct route *n = key[0] == '/' ? &absRoutes : &relRoutes;
+	const char *p = key;
+	while (1){
+		if (n->remote){
+			return 1;
+		}
+		while (*p == '/'){
+			p++;
+		}
+		if (*p == '\0' || strcmp(p, ".") == 0){
+			break;
+		}
+		const char *e = strchr(p, '/');
+		size_t c = e ? (size_t)(e - p) : strlen(p);
+		struct route *next = routeChild(n, p, c, create);
+		if (next == NULL){
+			return 0;
+		}
+		n = next;
+		p += c;
+	}
+	if (create){
+		n->remote = 1;
+	}
+	return n->remote;
+}
+
+/// @brief add the colon separated prefixes of spec (remote15440) to the routing trie;
+/// 	   "." makes every relative path remote
+void routeInit(const char *spec){
+	char *list = strdup(spec);
+	if (list == NULL){
+		fatal();
+	}
+	char *save = NULL;
+	for (char *prefix = strtok_r(list, ":", &save); prefix; prefix = strtok_r(NULL, ":", &save)){
+		char *key = canonicalPath(prefix);
+		routeWalk(key, 1);
+		free(key);
+		routing = 1;
+	}
+	free(list);
+}
+
+/// @brief decide whether path is served by the server or by the local file system
+/// @return 1 if path is remote
+int isRemote(const char *path){
+	if (!routing){
+		return 1;
+	}
+	char *key = canonicalPath(path);
+	int remote = routeWalk(key, 0);
+	free(key);
+	return remote;
+}
+
+/// @brief hash bucket of canonical path
+struct attr **attrBucket(const char *path){
+	unsigned h = 5381;
+	while (*path){
+		h = h*33 + (unsigned char)*path++;
+	}
+	return &attrs[h % ATTRBUCKETS];
+}
+
+/// @brief look up the unexpired attributes of canonical path
+/// @return the entry, NULL if there is none
+struct attr *attrFind(const char *path){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (struct attr *a = *attrBucket(path); a; a = a->next){
+		if (strcmp(a->path, path) == 0){
+			if (now.tv_sec > a->expires.tv_sec 
+				|| (now.tv_sec == a->expires.tv_sec && now.tv_nsec >= a->expires.tv_nsec)){
+				return NULL;
+			}
+			return a;
+		}
+	}
+	return NULL;
+}
+
+/// @brief forget the cached attributes of canonical path
+void attrDrop(const char *path){
+	struct attr **p = attrBucket(path);
+	while (*p){
+		if (strcmp((*p)->path, path) == 0){
+			struct attr *a = *p;
+			*p = a->next;
+			free(a->path);
+			free(a);
+			nattrs--;
+			return;
+		}
+		p = &(*p)->next;
+	}
+}
+
+/// @brief forget all cached attributes
+void attrClear(void){
+	for (int i = 0; i < ATTRBUCKETS; i++){
+		while (attrs[i]){
+			struct attr *a = attrs[i];
+			attrs[i] = a->next;
+			free(a->path);
+			free(a);
+		}
+	}
+	nattrs = 0;
+}
+
+/// @brief cache the result of stat on canonical path for attrTtl milliseconds
+void attrStore(const char *path, int res, int error, struct stat *st){
+	attrDrop(path);
+	if (nattrs >= MAXATTRS){
+		attrClear();
+	}
+	struct attr *a = malloc(sizeof(struct attr));
+	if (a == NULL){
+		fatal();
+	}
+	a->path = strdup(path);
+	if (a->path == NULL){
+		fatal();
+	}
+	a->res = res;
+	a->err = error;
+	a->st = *st;
+	clock_gettime(CLOCK_MONOTONIC, &a->expires);
+	a->expires.tv_sec += attrTtl / 1000;
+	a->expires.tv_nsec += (attrTtl % 1000) * 1000000;
+	if (a->expires.tv_nsec >= 1000000000){
+		a->expires.tv_sec++;
+		a->expires.tv_nsec -= 1000000000;
+	}
+	struct attr **b = attrBucket(path);
+	a->next = *b;
+	*b = a;
+	nattrs++;
+}
+
+/// @brief marshall a request for op into the batch instead of sending it, so that it
+/// 	   travels together with the next request that is sent
+/// @param op operation code
+/// @param params parameter segments (copied)
+/// @param cnt number of segments
+/// @param flags RPC_* request flags
+/// @return id of the request, 0 if it does not fit in the batch
+unsigned batchRequest(int op, struct iovec *params, int cnt, int flags){
+	struct reqHdr h;
+	h.op = op;
+	h.len = 0;
+	h.flags = flags;
+	for (int i = 0; i < cnt; i++){
+		h.len += params[i].iov_len;
+	}
+	if (batchLen + sizeof(h) + h.len > BATCHLEN){
+		return 0;
+	}
+	h.id = nextId++;
+	memcpy(batch+batchLen, &h, sizeof(h));
+	batchLen += sizeof(h);
+	for (int i = 0; i < cnt; i++){
+		memcpy(batch+batchLen, params[i].iov_base, params[i].iov_len);
+		batchLen += params[i].iov_len;
+	}
+	return h.id;
+}
+
+/// @brief start connecting to the caching agent, or to the server if there is none
+/// @param nonblock only start the TCP handshake, connectFinish completes it
+void connectStart(int nonblock){
+	if (agentPath){
+		struct sockaddr_un un;
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strcpy(un.sun_path, agentPath);
+		sockfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if (sockfd < 0){
+			fatal();
+		}
+		if (connect(sockfd, (struct sockaddr*)&un, sizeof(un)) == 0){
+			connInit(&conn, sockfd);
+			connState = C_UP;
+			viaAgent = 1;
+			return;
+		}
+		orig_close(sockfd);	// no agent after all, talk to the server directly
+	}
+	sockfd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC|(nonblock ? SOCK_NONBLOCK : 0), 0);
+	if (sockfd < 0){
+		fatal();
+	}
+	if (connect(sockfd, (struct sockaddr*)&srvAddr, sizeof(srvAddr)) < 0){
+		if (!nonblock || errno != EINPROGRESS){
+			fatal();
+		}
+		connState = C_PENDING;
+		return;
+	}
+	if (nonblock && fcntl(sockfd, F_SETFL, 0) < 0){
+		fatal();
+	}
+	connInit(&conn, sockfd);
+	connState = C_UP;
+}
+
+/// @brief make sure the connection is up before a request goes out, completing
+/// 	   a connect started early or connecting now
+void connectFinish(void){
+	if (connState == C_UP){
+		return;
+	}
+	if (connState == C_NONE){
+		connectStart(0);
+		return;
+	}
+	struct pollfd p = {sockfd, POLLOUT, 0};
+	while (poll(&p, 1, -1) < 0){
+		if (errno != EINTR){
+			fatal();
+		}
+	}
+	int error = 0;
+	socklen_t len = sizeof(int);
+	if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0){
+		fatal();
+	}
+	if (error){
+		errno = error;
+		fatal();
+	}
+	if (fcntl(sockfd, F_SETFL, 0) < 0){
+		fatal();
+	}
+	connInit(&conn, sockfd);
+	connState = C_UP;
+}
 
-	char* msg = arg;
+/// @brief take the receive side unless another thread owns it
+/// @return 1 if this thread owns the receive side
+int recvTake(void){
+	if (!recvOwner && !receiving){
+		receiving = 1;
+		recvOwner = 1;
+	}
+	return recvOwner;
+}
 
-	send(sockfd, msg, arglen, 0); //send request pakcet to server
-	char size[4];
+/// @brief receive the next reply header as the owner of the receive side, letting
+/// 	   go of clientMutex while blocked
+void recvHeader(struct replyHdr *h){
 	int rv;
+	if (conn.end - conn.start >= sizeof(*h)){
+		rv = connRecv(&conn, h, sizeof(*h));
+	}else{
+		pthread_mutex_unlock(&clientMutex);
+		rv = connRecv(&conn, h, sizeof(*h));
+		pthread_mutex_lock(&clientMutex);
+	}
+	if (rv < 0){
+		fatal();
+	}
+}
+
+/// @brief wait until no other thread is sending, so that what the caller checks
+/// 	   before sending a request still holds once it is sent
+void sendIdle(void){
+	recvDone();		//the receive side must not wait on a thread blocked in a send
+	while (sending){
+		pthread_cond_wait(&progress, &clientMutex);
+	}
+}
+
+/// @brief send the n segments of iov, letting go of clientMutex while blocked so the
+/// 	   owner of the receive side keeps draining replies meanwhile. The caller has
+/// 	   waited in sendIdle and records the requests before it lets go of clientMutex again
+/// @param last id of the last request in iov
+void transmit(struct iovec *iov, int n, unsigned last){
+	sending = 1;
+	connectFinish();
+	pthread_mutex_unlock(&clientMutex);
+	int rv = connSendv(&conn, iov, n);
+	pthread_mutex_lock(&clientMutex);
+	if (rv < 0){ //send request pakcet to server
+		fatal();
+	}
+	sending = 0;
+	registeredId = last;
+	pthread_cond_broadcast(&progress);
+}
+
+/// @brief send the requests held in the batch on their own
+void flushBatch(void){
+	sendIdle();
+	if (batchLen == 0){
+		return;
+	}
+	char held[BATCHLEN];
+	struct reqHdr h;
+	h.op = OP_COMPOUND;
+	h.len = batchLen;
+	h.id = nextId++;
+	h.flags = 0;
+	memcpy(held, batch, batchLen);
+	struct iovec iov[2] = {{&h, sizeof(h)}, {held, batchLen}};
+	batchLen = 0;
+	transmit(iov, 2, h.id);
+}
+
+/// @brief marshall the request header for op and send it followed by the parameter 
+/// 	   segments. Requests held in the batch go first, in one compound request
+/// 	   with this one unless its payload is large
+/// @param op operation code
+/// @param params parameter segments (caller-owned, consumed in place)
+/// @param cnt number of segments
+/// @param flags RPC_* request flags
+/// @return id of the request
+unsigned sendRequest(int op, struct iovec *params, int cnt, int flags){
+	struct reqHdr outer;
+	struct reqHdr h;
+	struct iovec iov[cnt+3];
+	char held[BATCHLEN];	//the batch fills again while this goes out
+	int n = 0;
+	sendIdle();
+	h.op = op;
+	h.len = 0;
+	h.flags = flags;
+	for (int i = 0; i < cnt; i++){
+		h.len += params[i].iov_len;
+	}
+	while (batchLen > 0 && h.len > BATCHLEN){
+		//a large payload goes on its own: the server streams it to the file rather than
+		//holding a whole compound in memory
+		flushBatch();
+	}
+	if (batchLen > 0){
+		outer.op = OP_COMPOUND;
+		outer.len = batchLen + sizeof(h) + h.len;
+		outer.id = nextId++;
+		outer.flags = 0;
+		memcpy(held, batch, batchLen);
+		iov[n].iov_base = &outer;
+		iov[n++].iov_len = sizeof(outer);
+		iov[n].iov_base = held;
+		iov[n++].iov_len = batchLen;
+	}
+	h.id = nextId++;
+	iov[n].iov_base = &h;
+	iov[n++].iov_len = sizeof(h);
+	for (int i = 0; i < cnt; i++){
+		iov[n++] = params[i];
+	}
+	batchLen = 0;
+	transmit(iov, n, h.id);
+	return h.id;
+}
+
+/// @brief consume the failure reply h of a one-way request and defer its error
+/// 	   to the fd the request was made on
+/// @param h header of the reply, already received
+void onewayFailed(struct replyHdr *h){
+	char body[sizeof(ssize_t) + sizeof(int)];	//the largest failure reply, that of a write
+	if (h->len < (long long)sizeof(int) || h->len > (long long)sizeof(body)){
+		errno = EPROTO;
+		fatal();
+	}
+	if (connRecv(&conn, body, h->len) < 0){
+		fatal();
+	}
+	//entries older than h were answered by silence, i.e. succeeded
+	while (pendCnt > 0 && (int)(pend[pendHead].id - h->id) < 0){
+		pendHead = (pendHead+1) % MAXPENDING;
+		pendCnt--;
+	}
+	if (pendCnt == 0 || pend[pendHead].id != h->id){
+		errno = EPROTO;	//a reply no request is waiting for
+		fatal();
+	}
+	int fd = pend[pendHead].fd;
+	pendHead = (pendHead+1) % MAXPENDING;
+	pendCnt--;
+	if (fd >= 0){
+		memcpy(&fileOf(fd)->err, body + h->len - sizeof(int), sizeof(int)); //errno is the last field
+	}
+}
+
+/// @brief find the block number no of remote fd in the cache
+/// @return the block, NULL if it is not cached
+struct block *blockFind(int fd, off_t no){
+	struct block *b = buckets[(fd*31 + no) % NBUCKETS];
+	while (b && (b->fd != fd || b->no != no)){
+		b = b->hnext;
+	}
+	return b;
+}
+
+/// @brief take block b out of the hash table, so it can no longer be found
+void blockUnhash(struct block *b){
+	struct block **p = &buckets[(b->fd*31 + b->no) % NBUCKETS];
+	while (*p && *p != b){
+		p = &(*p)->hnext;
+	}
+	if (*p){
+		*p = b->hnext;
+	}
+	b->fd = -1;
+}
+
+/// @brief mark b as the most recently used block
+void blockTouch(struct block *b){
+	if (lruHead == b){
+		return;
+	}
+	b->prev->next = b->next;	//b is not the head, so it has a prev
+	if (b->next){
+		b->next->prev = b->prev;
+	}else{
+		lruTail = b->prev;
+	}
+	b->prev = NULL;
+	b->next = lruHead;
+	lruHead->prev = b;
+	lruHead = b;
+}
+
+/// @brief remove b from the cache and release it
+void blockFree(struct block *b){
+	if (b->fd >= 0){
+		blockUnhash(b);
+	}
+	if (b->prev){
+		b->prev->next = b->next;
+	}else{
+		lruHead = b->next;
+	}
+	if (b->next){
+		b->next->prev = b->prev;
+	}else{
+		lruTail = b->prev;
+	}
+	cacheUsed -= sizeof(struct block);
+	free(b);
+}
+
+/// @brief add an empty block number no of fd to the cache, evicting the least
+/// 	   recently used blocks that are not waiting for readahead to stay in the budget
+/// @return the block, NULL if the budget is taken up by readahead in flight
+struct block *blockAlloc(int fd, off_t no){
+	struct block *victim = lruTail;
+	while (cacheUsed + sizeof(struct block) > cacheBudget && victim){
+		struct block *prev = victim->prev;
+		if (victim->id == 0){
+			blockFree(victim);
+		}
+		victim = prev;
+	}
+	if (cacheUsed + sizeof(struct block) > cacheBudget){
+		return NULL;
+	}
+	struct block *b = malloc(sizeof(struct block));
+	if (b == NULL){
+		fatal();
+	}
+	cacheUsed += sizeof(struct block);
+	b->fd = fd;
+	b->no = no;
+	b->id = 0;
+	b->len = 0;
+	b->err = 0;
+	b->prev = NULL;
+	b->next = lruHead;
+	if (lruHead){
+		lruHead->prev = b;
+	}else{
+		lruTail = b;
+	}
+	lruHead = b;
+	b->hnext = buckets[(fd*31 + no) % NBUCKETS];
+	buckets[(fd*31 + no) % NBUCKETS] = b;
+	return b;
+}
+
+/// @brief receive the reply of a positional read of one block into b
+/// @param b the block
+/// @param len length of the reply, whose header was already received
+void recvBlock(struct block *b, long long len){
+	ssize_t res;
+	int error;
+	if (len < (long long)(sizeof(ssize_t)+sizeof(int)) || len > (long long)(BLOCKLEN+sizeof(ssize_t)+sizeof(int))){
+		errno = EPROTO;
+		fatal();
+	}
+	len -= sizeof(ssize_t)+sizeof(int);
+	if (connRecv(&conn, &res, sizeof(ssize_t)) < 0 || connRecv(&conn, &error, sizeof(int)) < 0
+		|| connRecv(&conn, b->data, len) < 0){
+		fatal();
+	}
+	b->id = 0;
+	b->len = res > 0 ? res : 0;
+	b->err = res < 0;
+}
+
+/// @brief consume reply h that is not the one being waited for: either the next
+/// 	   readahead reply, which fills its block, or the failure of a one-way request
+/// @param h header of the reply, already received
+void routeReply(struct replyHdr *h){
+	if (aheadCnt > 0 && ahead[aheadHead]->id == h->id){
+		struct block *b = ahead[aheadHead];
+		aheadHead = (aheadHead+1) % MAXREADAHEAD;
+		aheadCnt--;
+		recvBlock(b, h->len);
+		if (b->fd < 0 || b->err){	//its fd was closed, or it is fetched again on demand
+			blockFree(b);
+		}
+		return;
+	}
+	onewayFailed(h);
+}
+
+/// @brief route reply h, received by the owner of the receive side: the reply and the
+/// 	   receive side go to the thread waiting for it, anything else is consumed here
+/// @param h header of the reply, already received
+void dispatchReply(struct replyHdr *h){
+	//the reply beat its sender back to clientMutex, which records it next
+	while ((int)(h->id - registeredId) > 0){
+		pthread_cond_wait(&progress, &clientMutex);
+	}
+	for (struct waiter *w = waiters; w; w = w->next){
+		if (w->id == h->id){
+			w->h = *h;
+			w->ready = 1;
+			recvOwner = 0;	//receiving stays set, the receive side is w's now
+			pthread_cond_broadcast(&progress);
+			return;
+		}
+	}
+	routeReply(h);
+}
 
-	while((rv =recv(sockfd, size, sizeof(int), 0)) >0){ // this receives the size of the entire buffer
-		if (*(int*)size > 0){
+/// @brief wait for the reply of request id, receiving and routing other replies
+/// 	   while this thread owns the receive side, then receive only the fixed-size
+/// 	   header of that reply. The thread owns the receive side until the payload is consumed
+/// @param id the request to wait for
+/// @param hdr destination of the reply header
+/// @param hdrLen size of the reply header
+/// @return number of payload bytes that follow the header on the connection
+ssize_t waitReply(unsigned id, void *hdr, int hdrLen){
+	struct waiter w = {id, 0};
+	struct replyHdr h;
+	recvDone();
+	w.next = waiters;
+	waiters = &w;
+	while (1){
+		if (w.ready){
+			h = w.h;
+			recvOwner = 1;
 			break;
 		}
+		if (recvTake()){
+			recvHeader(&h);
+			if (h.id == id){
+				break;
+			}
+			dispatchReply(&h);
+			continue;
+		}
+		pthread_cond_wait(&progress, &clientMutex);
+	}
+	struct waiter **p = &waiters;
+	while (*p != &w){
+		p = &(*p)->next;
+	}
+	*p = w.next;
+	//everything sent before id has completed
+	while (pendCnt > 0 && (int)(pend[pendHead].id - id) < 0){
+		pendHead = (pendHead+1) % MAXPENDING;
+		pendCnt--;
+	}
+	if ((int)(id - syncedId) > 0){
+		syncedId = id;
+	}
+	if (h.len < hdrLen){
+		errno = EPROTO;
+		fatal();
+	}
+	if (connRecv(&conn, hdr, hdrLen) < 0){
+		fatal();
+	}
+	return h.len - hdrLen;
+}
+
+/// @brief handle, without blocking, the failure replies of one-way requests and the
+/// 	   readahead replies that have already arrived, so they never pile up in the socket buffers
+void reapReplies(void){
+	while ((pendCnt > 0 || aheadCnt > 0) && recvTake() && connReady(&conn)){
+		struct replyHdr h;
+		recvHeader(&h);
+		dispatchReply(&h);
+	}
+	recvDone();
+}
+
+/// @brief send op with the parameter segments params and receive only the fixed-size 
+/// 	   header of the reply, leaving any payload on the connection for the caller to consume
+/// @param op operation code
+/// @param params parameter segments (marshalled fields followed by any caller-owned payload)
+/// @param cnt number of segments
+/// @param hdr destination of the reply header
+/// @param hdrLen size of the reply header
+/// @return number of payload bytes that follow the header on the connection
+ssize_t callServerv(int op, struct iovec *params, int cnt, void *hdr, int hdrLen){
+	unsigned id = sendRequest(op, params, cnt, 0);
+	return waitReply(id, hdr, hdrLen);
+}
+
+/// @brief send op with the marshalled parameters arg and receive only the fixed-size 
+/// 	   header of the reply, leaving any payload on the connection for the caller to consume
+/// @param op operation code
+/// @param arg marshalled parameters
+/// @param arglen length of the parameters
+/// @param hdr destination of the reply header
+/// @param hdrLen size of the reply header
+/// @return number of payload bytes that follow the header on the connection
+ssize_t callServer(int op, void* arg, int arglen, void *hdr, int hdrLen){
+	struct iovec iov;
+	iov.iov_base = arg;
+	iov.iov_len = arglen;
+	return callServerv(op, &iov, 1, hdr, hdrLen);
+}
+
+/// @brief receive the payload of a reply straight into the caller's buffer
+/// @param dst destination of the payload
+/// @param n number of payload bytes to receive
+void recvPayload(void *dst, size_t n){
+	if (connRecv(&conn, dst, n) < 0){
+		fatal();
+	}
+}
+
+/// @brief record that one-way request id, whose failure is deferred to fd, may still fail
+void addPending(unsigned id, int fd){
+	pend[(pendHead+pendCnt) % MAXPENDING].id = id;
+	pend[(pendHead+pendCnt) % MAXPENDING].fd = fd;
+	pendCnt++;
+	if (fd >= 0){
+		fileOf(fd)->lastOneway = id;
+	}
+}
+
+/// @brief send op one-way if that is enabled for op, i.e. without waiting for its reply
+/// @param op operation code
+/// @param fd remote fd a failure is deferred to, -1 if none
+/// @param params parameter segments
+/// @param cnt number of segments
+/// @return 1 if the request was sent one-way, 0 if the caller must make a synchronous call
+int sendOneway(int op, int fd, struct iovec *params, int cnt){
+	if (!(onewayOps & (1 << op))){
+		return 0;
+	}
+	sendIdle();
+	if (pendCnt == MAXPENDING){
+		return 0;	//a synchronous call also resolves all pending entries
+	}
+	addPending(sendRequest(op, params, cnt, RPC_ONEWAY), fd);
+	reapReplies();
+	return 1;
+}
+
+/// @brief like sendOneway, but small requests are held in the batch and only go out
+/// 	   with the next request, costing neither a round trip nor a packet of their own
+/// @return 1 if the request was batched or sent one-way, 0 if the caller must make a synchronous call
+int deferOneway(int op, int fd, struct iovec *params, int cnt){
+	if (!(onewayOps & (1 << op)) || pendCnt == MAXPENDING){
+		return 0;
+	}
+	unsigned id = batchRequest(op, params, cnt, RPC_ONEWAY);
+	if (id == 0){
+		return sendOneway(op, fd, params, cnt);	//goes out together with the full batch
+	}
+	addPending(id, fd);
+	return 1;
+}
+
+/// @brief drop the cached blocks of fd. Blocks still waiting for readahead are
+/// 	   released when their reply arrives
+/// @param fd the server's fd
+void dropBlocks(int fd){
+	struct block *b = lruHead;
+	while (b){
+		struct block *next = b->next;
+		if (b->fd == fd){
+			if (b->id == 0){
+				blockFree(b);
+			}else{
+				blockUnhash(b);
+			}
+		}
+		b = next;
+	}
+}
+
+/// @brief drop everything cached about the file fd refers to, on every fd of that
+/// 	   file, once it is written through fd
+/// @param fd the server's fd
+void invalidateFile(int fd){
+	struct rfile *f = fileOf(fd);
+	for (int i = 0; i < nfiles; i++){
+		struct rfile *g = fileOf(i);
+		if (g->cached && g->dev == f->dev && g->ino == f->ino){
+			dropBlocks(i);
+			free(g->pre);
+			g->pre = NULL;
+			g->preLen = 0;
+			g->preEof = 0;
+		}
+	}
+}
+
+/// @brief marshall the fields of a write of n bytes on fd: a positional write at off
+/// 	   for a tracked fd, a write at the server's offset of the fd otherwise
+/// @param buff destination, sizeof(int)+sizeof(size_t)+sizeof(off_t) bytes
+/// @param len set to the length of the fields
+/// @param off where the bytes go, -1 for the server's offset
+/// @return operation code of the write
+int marshallWrite(char *buff, int *len, int fd, size_t n, off_t off){
+	int cnt = 0;
+	memcpy(buff+cnt, &fd, sizeof(int));
+	cnt += sizeof(int);
+	memcpy(buff+cnt, &n, sizeof(size_t));
+	cnt += sizeof(size_t);
+	if (off >= 0){
+		memcpy(buff+cnt, &off, sizeof(off_t));
+		cnt += sizeof(off_t);
+	}
+	*len = cnt;
+	return off >= 0 ? OP_PWRITE : OP_WRITE;
+}
+
+/// @brief send the writes held in the write-behind buffer of fd, one-way when that is
+/// 	   enabled. A failure is deferred to the next call on fd either way
+/// @param fd the server's fd
+void flushWrites(int fd){
+	struct rfile *f = fileOf(fd);
+	sendIdle();		//the buffer is taken when it can go out at once, ahead of later calls on fd
+	if (f->wbLen == 0){
+		return;
+	}
+	char buff[sizeof(int) + sizeof(size_t) + sizeof(off_t)];
+	int cnt;
+	int op = marshallWrite(buff, &cnt, fd, f->wbLen, f->tracked ? f->wbOff : -1);
+	struct iovec iov[2] = {{buff, cnt}, {f->wb, f->wbLen}};
+	char *wb = f->wb;	//goes out as it is, writes made meanwhile start a new buffer
+	f->wb = NULL;
+	f->wbLen = 0;
+	wbFiles--;
+	if (sendOneway(op, fd, iov, 2)){
+		free(wb);
+		return;
+	}
+	char hdr[sizeof(ssize_t)+sizeof(int)];
+	callServerv(op, iov, 2, hdr, sizeof(hdr));
+	free(wb);
+	ssize_t res = *(ssize_t*)hdr;
+	if (res < 0){
+		memcpy(&f->err, hdr+sizeof(ssize_t), sizeof(int));
+	}
+}
+
+/// @brief send the unsent writes of every fd of the file fd refers to, so that
+/// 	   what the server returns next reflects them
+/// @param fd the server's fd, -1 for all files
+void flushFile(int fd){
+	for (int i = 0; i < nfiles && wbFiles > 0; i++){
+		struct rfile *g = fileOf(i);
+		if (g->wbLen > 0 && (fd < 0 || (g->dev == fileOf(fd)->dev && g->ino == fileOf(fd)->ino))){
+			flushWrites(i);
+		}
+	}
+}
+
+/// @brief make progress while a block the caller needs is being fetched: receive and
+/// 	   route the next reply, or wait for the thread owning the receive side to
+void waitAhead(void){
+	if (!recvTake()){
+		pthread_cond_wait(&progress, &clientMutex);
+		return;
+	}
+	struct replyHdr h;
+	recvHeader(&h);
+	dispatchReply(&h);
+}
+
+/// @brief marshall the parameters of a positional read
+/// @param buff destination, sizeof(int)+sizeof(size_t)+sizeof(off_t) bytes
+/// @return length of the parameters
+int marshallPread(char *buff, int fd, size_t n, off_t off){
+	int cnt = 0;
+	memcpy(buff+cnt, &fd, sizeof(int));
+	cnt += sizeof(int);
+	memcpy(buff+cnt, &n, sizeof(size_t));
+	cnt += sizeof(size_t);
+	memcpy(buff+cnt, &off, sizeof(off_t));
+	cnt += sizeof(off_t);
+	return cnt;
+}
+
+/// @brief the segments of iov that cover bytes [from, from+len) of it
+/// @param out destination, room for iovcnt segments
+/// @return number of segments in out
+int iovSlice(const struct iovec *iov, int iovcnt, size_t from, size_t len, struct iovec *out){
+	int n = 0;
+	for (int i = 0; i < iovcnt && len > 0; i++){
+		if (from >= iov[i].iov_len){
+			from -= iov[i].iov_len;
+			continue;
+		}
+		size_t cnt = iov[i].iov_len - from < len ? iov[i].iov_len - from : len;
+		out[n].iov_base = (char*)iov[i].iov_base + from;
+		out[n++].iov_len = cnt;
+		from = 0;
+		len -= cnt;
+	}
+	return n;
+}
+
+/// @brief connect stripe s to the server and move it into the group with key. Runs
+/// 	   without clientMutex, on a stripe the caller claimed
+/// @return 0 on success, -1 if the stripe cannot be used
+int stripeConnect(struct stripe *s, unsigned long long key){
+	int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0){
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr*)&srvAddr, sizeof(srvAddr)) < 0){
+		orig_close(fd);
+		return -1;
+	}
+	connInit(&s->c, fd);
+	struct reqHdr h = {OP_JOIN, sizeof(key), 1, 0};
+	struct iovec iov[2] = {{&h, sizeof(h)}, {&key, sizeof(key)}};
+	struct replyHdr rh;
+	int reply[2];
+	if (connSendv(&s->c, iov, 2) < 0 || connRecv(&s->c, &rh, sizeof(rh)) < 0
+		|| rh.len != sizeof(reply) + sizeof(key) || connRecv(&s->c, reply, sizeof(reply)) < 0
+		|| connRecv(&s->c, &key, sizeof(key)) < 0 || reply[0] < 0){
+		connFree(&s->c);
+		orig_close(fd);
+		return -1;
+	}
+	s->up = 1;
+	return 0;
+}
+
+/// @brief drop the connection of stripe s, after it failed midway through a transfer
+void stripeDrop(struct stripe *s){
+	orig_close(s->c.fd);
+	connFree(&s->c);
+	s->up = 0;
+}
+
+/// @brief send what can go without blocking of the requests of leg l, the payload of
+/// 	   a write straight from iov
+/// @param k index of the leg, m number of legs
+void legSend(struct leg *l, int k, int m, int op, int fd, const struct iovec *iov, int iovcnt,
+	size_t nbyte, off_t off){
+	while (l->sent < l->cnt){
+		if (l->outCnt == 0){
+			size_t from = (size_t)(k + l->sent*m) * stripeLen;
+			size_t len = nbyte - from < stripeLen ? nbyte - from : stripeLen;
+			int cnt;
+			if (op == OP_PWRITE){
+				marshallWrite(l->fields, &cnt, fd, len, off + from);
+			}else{
+				cnt = marshallPread(l->fields, fd, len, off + from);
+			}
+			l->h.op = op;
+			l->h.len = cnt + (op == OP_PWRITE ? len : 0);
+			l->h.id = k + l->sent*m + 1;
+			l->h.flags = 0;
+			l->out[0].iov_base = &l->h;
+			l->out[0].iov_len = sizeof(l->h);
+			l->out[1].iov_base = l->fields;
+			l->out[1].iov_len = cnt;
+			l->outCnt = 2;
+			if (op == OP_PWRITE){
+				l->outCnt += iovSlice(iov, iovcnt, from, len, l->out+2);
+			}
+		}
+		int rv = connSendvSome(&l->s->c, l->out, l->outCnt);
+		if (rv < 0){
+			l->failed = 1;
+		}
+		if (rv != 0){
+			return;
+		}
+		l->outCnt = 0;
+		l->sent++;
+	}
+}
+
+/// @brief receive what has arrived of the replies of leg l, read data straight into iov
+/// @param k index of the leg, m number of legs
+/// @param res results of the ranges, filled in as their replies complete
+/// @param errs errno of the ranges
+void legRecv(struct leg *l, int k, int m, const struct iovec *iov, int iovcnt, size_t nbyte,
+	ssize_t *res, int *errs){
+	while (l->recvd < l->sent){
+		size_t from = (size_t)(k + l->recvd*m) * stripeLen;
+		size_t len = nbyte - from < stripeLen ? nbyte - from : stripeLen;
+		ssize_t rv;
+		if (l->hdrGot < sizeof(l->hdr)){
+			rv = connRecvSome(&l->s->c, l->hdr + l->hdrGot, sizeof(l->hdr) - l->hdrGot);
+			if (rv <= 0){
+				l->failed = rv < 0;
+				return;
+			}
+			l->hdrGot += rv;
+			continue;
+		}
+		struct replyHdr h;
+		memcpy(&h, l->hdr, sizeof(h));
+		size_t rest = h.len - (sizeof(ssize_t) + sizeof(int));
+		if (h.len < (int)(sizeof(ssize_t) + sizeof(int)) || rest > len){
+			l->failed = 1;
+			return;
+		}
+		if (l->got < rest){
+			struct iovec seg[iovcnt];	//the range may span several segments, the first is filled
+			iovSlice(iov, iovcnt, from + l->got, rest - l->got, seg);
+			rv = connRecvSome(&l->s->c, seg[0].iov_base, seg[0].iov_len);
+			if (rv <= 0){
+				l->failed = rv < 0;
+				return;
+			}
+			l->got += rv;
+			continue;
+		}
+		int r = k + l->recvd*m;
+		memcpy(&res[r], l->hdr + sizeof(h), sizeof(ssize_t));
+		memcpy(&errs[r], l->hdr + sizeof(h) + sizeof(ssize_t), sizeof(int));
+		l->recvd++;
+		l->hdrGot = 0;
+		l->got = 0;
+	}
+}
+
+/// @brief a positional read or write of nbyte bytes at off on remote fd, split into
+/// 	   ranges of stripeLen bytes that go out over the idle stripe connections in
+/// 	   parallel, so one large transfer is not held to what one stream can carry.
+/// 	   Read data lands straight in iov, written data goes out straight from it
+/// @param op OP_PREAD or OP_PWRITE
+/// @return bytes transferred, -1 with errno set on failure, -2 if the transfer is not
+/// 	   striped and has to go over the main connection
+ssize_t stripedTransfer(int op, int fd, const struct iovec *iov, int iovcnt, size_t nbyte, off_t off){
+	if (nstripes == 0 || viaAgent || off < 0 || nbyte < 2*stripeLen){
+		return -2;
+	}
+	int ranges = (nbyte + stripeLen - 1) / stripeLen;
+	struct stripe *claimed[MAXSTRIPES];
+	int m = 0;
+	for (int i = 0; i < nstripes && m < ranges; i++){
+		if (!stripes[i].busy){
+			stripes[i].busy = 1;
+			claimed[m++] = &stripes[i];
+		}
+	}
+	if (m == 0){
+		return -2;	//all taken by other threads' transfers
+	}
+	if (groupKey == 0 || batchLen > 0 || pendCnt > 0){
+		//the server serves the request after everything sent before it, so the stripes
+		//also find the one-way writes made so far done
+		unsigned long long zero = 0;
+		char reply[sizeof(int)*2 + sizeof(unsigned long long)];
+		callServer(OP_JOIN, &zero, sizeof(zero), reply, sizeof(reply));
+		recvDone();
+		memcpy(&groupKey, reply + sizeof(int)*2, sizeof(unsigned long long));
+	}
+	unsigned long long key = groupKey;
+	pthread_mutex_unlock(&clientMutex);
+
+	//stripes that cannot connect are left out, the ranges are spread over the others
+	struct leg legs[MAXSTRIPES];
+	int up = 0;
+	for (int i = 0; i < m; i++){
+		if (claimed[i]->up || stripeConnect(claimed[i], key) == 0){
+			memset(&legs[up], 0, sizeof(struct leg));
+			legs[up++].s = claimed[i];
+		}
+	}
+	if (up == 0){
+		pthread_mutex_lock(&clientMutex);
+		for (int i = 0; i < m; i++){
+			claimed[i]->busy = 0;
+		}
+		nstripes = 0;	//the server takes no more connections, stay on the main one
+		return -2;
+	}
+	ssize_t *res = malloc(ranges * sizeof(ssize_t));
+	int *errs = malloc(ranges * sizeof(int));
+	struct iovec *outs = malloc(up * (iovcnt+2) * sizeof(struct iovec));
+	if (res == NULL || errs == NULL || outs == NULL){
+		fatal();
+	}
+	for (int k = 0; k < up; k++){
+		legs[k].cnt = ranges / up + (k < ranges % up);
+		legs[k].out = outs + k*(iovcnt+2);
+	}
+	while (1){
+		struct pollfd p[MAXSTRIPES];
+		int wait = -1;
+		int active = 0;
+		for (int k = 0; k < up; k++){
+			struct leg *l = &legs[k];
+			p[k].fd = -1;
+			p[k].events = 0;
+			p[k].revents = 0;
+			if (l->failed || l->recvd == l->cnt){
+				continue;
+			}
+			active++;
+			p[k].fd = l->s->c.fd;
+			p[k].events = POLLIN | (l->sent < l->cnt ? POLLOUT : 0);
+			if (l->s->c.end > l->s->c.start){
+				wait = 0;	//a reply is already buffered
+			}
+		}
+		if (active == 0){
+			break;
+		}
+		if (poll(p, up, wait) < 0 && errno != EINTR){
+			fatal();
+		}
+		for (int k = 0; k < up; k++){
+			struct leg *l = &legs[k];
+			if (p[k].fd < 0){
+				continue;
+			}
+			if (p[k].revents & (POLLOUT|POLLERR|POLLHUP)){
+				legSend(l, k, up, op, fd, iov, iovcnt, nbyte, off);
+			}
+			if (!l->failed && ((p[k].revents & (POLLIN|POLLERR|POLLHUP)) || l->s->c.end > l->s->c.start)){
+				legRecv(l, k, up, iov, iovcnt, nbyte, res, errs);
+			}
+		}
+	}
+	//the transfer is what the ranges did up to the first one that fell short
+	ssize_t total = 0;
+	int error = 0;
+	for (int r = 0; r < ranges; r++){
+		size_t len = nbyte - (size_t)r*stripeLen < stripeLen ? nbyte - (size_t)r*stripeLen : stripeLen;
+		if (r / up >= legs[r % up].recvd){
+			error = EIO;	//its stripe connection broke
+			break;
+		}
+		if (res[r] < 0){
+			error = errs[r];
+			break;
+		}
+		total += res[r];
+		if ((size_t)res[r] < len){
+			break;
+		}
+	}
+	pthread_mutex_lock(&clientMutex);
+	for (int k = 0; k < up; k++){
+		if (legs[k].failed){
+			stripeDrop(legs[k].s);
+		}
+	}
+	for (int i = 0; i < m; i++){
+		claimed[i]->busy = 0;
+	}
+	free(res);
+	free(errs);
+	free(outs);
+	if (total == 0 && error){
+		errno = error;
+		return -1;
+	}
+	return total;
+}
+
+ssize_t agentSplit(int op, int fd, const struct iovec *iov, int iovcnt, size_t nbyte, off_t at);
+
+/// @brief read n bytes at off of remote fd into dst, leaving the fd's offset alone
+/// @return number of bytes read, -1 with errno set on failure
+ssize_t preadRemote(int fd, void *dst, size_t n, off_t off){
+	struct iovec iov = {dst, n};
+	if (viaAgent && n > AGENTMAXLEN){
+		return agentSplit(OP_PREAD, fd, &iov, 1, n, off);
+	}
+	ssize_t striped = stripedTransfer(OP_PREAD, fd, &iov, 1, n, off);
+	if (striped != -2){
+		return striped;
+	}
+	char buff[sizeof(int) + sizeof(size_t) + sizeof(off_t)];
+	int cnt = marshallPread(buff, fd, n, off);
+	char hdr[sizeof(ssize_t)+sizeof(int)];
+	ssize_t rest = callServer(OP_PREAD, buff, cnt, hdr, sizeof(hdr));
+	ssize_t res = *(ssize_t*)hdr;
+	int err = *(int*)(hdr+sizeof(ssize_t));
+	if (res < 0){
+		errno = err;
+	}else{
+		recvPayload(dst, rest);
+	}
+	return res;
+}
+
+/// @brief send positional reads, without waiting for them, for the blocks of the
+/// 	   readahead window of f that are not cached yet
+/// @param fd the server's fd
+/// @param f state of fd
+/// @param pos where the window starts
+void readAhead(int fd, struct rfile *f, off_t pos){
+	//keep the window within half the cache, so it never evicts the block being read
+	off_t window = f->window;
+	if ((size_t)window > cacheBudget / sizeof(struct block) / 2){
+		window = cacheBudget / sizeof(struct block) / 2;
+	}
+	off_t first = pos / BLOCKLEN;
+	for (off_t no = first; no <= first + window; no++){
+		sendIdle();	//so the checks below still hold when the read goes out
+		if (f->size >= 0 && no*BLOCKLEN >= f->size){
+			break;	//past the end of the file as it was when opened
+		}
+		if ((no+1)*BLOCKLEN <= (off_t)f->preLen){
+			continue;
+		}
+		struct block *b = blockFind(fd, no);
+		if (b){
+			if (b->id == 0 && b->len < BLOCKLEN){
+				break;	//the end of the file is already cached
+			}
+			continue;
+		}
+		if (aheadCnt == MAXREADAHEAD || (b = blockAlloc(fd, no)) == NULL){
+			break;
+		}
+		char buff[sizeof(int) + sizeof(size_t) + sizeof(off_t)];
+		struct iovec iov = {buff, marshallPread(buff, fd, BLOCKLEN, no*BLOCKLEN)};
+		b->id = FETCHING;	//until its id is known, the send lets go of clientMutex
+		b->id = sendRequest(OP_PREAD, &iov, 1, 0);
+		ahead[(aheadHead+aheadCnt) % MAXREADAHEAD] = b;
+		aheadCnt++;
+	}
+}
+
+/// @brief read of a cached fd: served from the inline head and the block cache,
+/// 	   fetching missing blocks. Sequential reads grow the readahead window, any
+/// 	   other read collapses it
+/// @param fd the server's fd
+/// @param f state of fd
+/// @param buf destination of the bytes
+/// @param nbyte how many bytes to read
+/// @param pos where to read
+/// @return number of bytes read, -1 with errno set on failure
+ssize_t cachedRead(int fd, struct rfile *f, char *buf, size_t nbyte, off_t pos){
+	off_t start = pos;
+	size_t done = 0;
+	if (pos < (off_t)f->preLen){	//served from the head returned inline by the open
+		done = f->preLen - pos < nbyte ? f->preLen - pos : nbyte;
+		memcpy(buf, f->pre + pos, done);
+		pos += done;
+	}else if (!f->preEof){
+		while (done < nbyte){
+			off_t no = pos / BLOCKLEN;
+			size_t in = pos % BLOCKLEN;
+			struct block *b;
+			while ((b = blockFind(fd, no)) != NULL && b->id != 0){
+				waitAhead();
+			}
+			if (b == NULL){
+				size_t left = nbyte - done;
+				if (left >= BLOCKLEN || (b = blockAlloc(fd, no)) == NULL){
+					//large reads go straight into the caller's buffer
+					ssize_t res = preadRemote(fd, buf+done, left, pos);
+					if (res < 0){
+						if (done == 0){
+							return -1;
+						}
+						break;
+					}
+					done += res;
+					pos += res;
+					break;
+				}
+				b->id = FETCHING;	//other threads wait for it rather than take it for empty
+				ssize_t res = preadRemote(fd, b->data, BLOCKLEN, no*BLOCKLEN);
+				b->id = 0;
+				if (res < 0){
+					int error = errno;
+					blockFree(b);
+					if (done == 0){
+						errno = error;
+						return -1;
+					}
+					break;
+				}
+				b->len = res;
+			}
+			blockTouch(b);
+			if (b->len <= in){
+				break;	//end of file
+			}
+			size_t n = b->len - in < nbyte - done ? b->len - in : nbyte - done;
+			memcpy(buf+done, b->data+in, n);
+			done += n;
+			pos += n;
+			if (b->len < BLOCKLEN && in + n == b->len){
+				break;
+			}
+		}
+	}
+	if (start == f->next){
+		f->window = f->window == 0 ? 1 : f->window < MAXWINDOW ? f->window*2 : MAXWINDOW;
+	}else{
+		f->window = 0;
+	}
+	f->next = pos;
+	if (f->window > 0 && nbyte < BLOCKLEN){	//large reads are fetched whole, not block by block
+		readAhead(fd, f, pos);
+	}
+	return done;
+}
+
+
+/// @brief open pathname on the server, marshalling and unmarshalling the 
+/// 	   request and reply packet respectively
+/// @param pathname path to the file to be opened
+/// @param flags flags for the opening file
+/// @param m mode of a created file
+/// @return local placeholder fd standing for the remote fd, -1 with errno set on failure
+int remoteOpen(const char *pathname, int flags, mode_t m) {
+    size_t pathLen = strlen(pathname);
+	int local = placeholderNew();	//before the open, so running out of fds costs no round trip
+	if (local < 0){
+		return -1;
+	}
+
+    char buf[sizeof(int)*2 + sizeof(size_t)];	//marshalled fields, the path is sent from the caller's string
+    int cnt = 0;
+    memcpy(buf+cnt,&flags,sizeof(int));
+    cnt += sizeof(int);
+    memcpy(buf+cnt, &m, sizeof(mode_t));
+    cnt += sizeof(int);
+    memcpy(buf+cnt, &pathLen, sizeof(size_t));
+    cnt += sizeof(size_t);
+	struct iovec iov[3] = {{buf, cnt}, {(char*)pathname, pathLen}};
+
+	//a read-only open also gets the head of the file back inline
+	size_t want = (flags & O_ACCMODE) == O_RDONLY ? inlineLen : 0;
+	iov[2].iov_base = &want;
+	iov[2].iov_len = sizeof(size_t);
+	char reply[sizeof(int)*2 + sizeof(off_t) + sizeof(dev_t) + sizeof(ino_t) + sizeof(long long)];
+	ssize_t rest = waitReply(sendRequest(OP_OPEN, iov, 3, RPC_INLINE), reply, sizeof(reply));
+    int res;
+    int err;
+	memcpy(&res, reply, sizeof(int));
+	memcpy(&err, reply+sizeof(int), sizeof(int));
+	char *pre = NULL;
+	if (rest > 0){
+		pre = malloc(rest);
+		if (pre == NULL){
+			fatal();
+		}
+		recvPayload(pre, rest);
+	}
+    if (res < 0){	//check if an error happened during execution
+		free(pre);
+		orig_close(local);
+        errno = err;
+		return res;
+    }
+	struct rfile *f = fileOf(res);
+	memset(f, 0, sizeof(struct rfile));
+	memcpy(&f->size, reply+sizeof(int)*2, sizeof(off_t));
+	memcpy(&f->dev, reply+sizeof(int)*2+sizeof(off_t), sizeof(dev_t));
+	memcpy(&f->ino, reply+sizeof(int)*2+sizeof(off_t)+sizeof(dev_t), sizeof(ino_t));
+	//appends go wherever the end is, only the server knows the position of such an fd
+	f->tracked = f->size >= 0 && (!(flags & O_APPEND) || (flags & O_ACCMODE) == O_RDONLY);
+	if (f->tracked && (flags & O_ACCMODE) == O_RDONLY){
+		f->cached = 1;
+		f->pre = pre;
+		f->preLen = rest;
+		f->preEof = (off_t)rest == f->size;
+	}else{
+		free(pre);
+	}
+	if ((flags & O_ACCMODE) != O_RDONLY){
+		invalidateFile(res);	//e.g. O_TRUNC, or writes to come
+		f->path = canonicalPath(pathname);	//writes invalidate its attributes
+	}
+	if (flags & (O_CREAT|O_TRUNC)){
+		char *key = canonicalPath(pathname);
+		attrDrop(key);
+		free(key);
+	}
+	fdBind(local, res);
+	return local;
+}
+
+/// @brief close placeholder fd and the remote fd it stands for, marshalling and
+/// 	   unmarshalling the request and reply packet respectively. The close is one-way
+/// 	   unless one-way writes on the fd are still unconfirmed, whose errors it then reports
+/// @param local the placeholder fd
+/// @return 0 if succesfully executed, -1 if an error happens
+int remoteClose(int local){
+	int fd = remoteFd(local);
+	if (fd < 0){
+		return orig_close(local);	//another thread closed it first
+	}
+	fdBind(local, -1);
+	orig_close(local);		//the placeholder
+	fprintf(stderr,"close called on fd: %d\n",fd);
+	struct iovec iov = {&fd, sizeof(int)};
+	struct rfile *f = fileOf(fd);
+	flushWrites(fd);
+	free(f->wb);
+	f->wb = NULL;
+	free(f->path);
+	f->path = NULL;
+	dropBlocks(fd);
+	free(f->pre);
+	f->pre = NULL;
+	f->cached = 0;
+	int unconfirmed = f->lastOneway != 0 && (int)(f->lastOneway - syncedId) > 0;
+	if (!unconfirmed && !f->err && deferOneway(OP_CLOSE, -1, &iov, 1)){
+		return 0;
+	}
+	int reply[2];
+	callServerv(OP_CLOSE, &iov, 1, reply, sizeof(reply));
+    int res = reply[0];
+    int err = reply[1];
+    if (res < 0){
+        errno = err;
+    }
+	if (takeError(fd) < 0){	//an earlier one-way write failed
+		res = -1;
+	}
+	return res;
+}
+
+/// @brief total length of the iovcnt segments of iov
+/// @return the length, -1 with errno set if iovcnt or the total is out of range
+ssize_t iovTotal(const struct iovec *iov, int iovcnt){
+	if (iovcnt < 0 || iovcnt > IOV_MAX){
+		errno = EINVAL;
+		return -1;
+	}
+	size_t n = 0;
+	for (int i = 0; i < iovcnt; i++){
+		if (iov[i].iov_len > (size_t)SSIZE_MAX - n){
+			errno = EINVAL;
+			return -1;
+		}
+		n += iov[i].iov_len;
+	}
+	return n;
+}
+
+/// @brief read into the iovcnt segments of iov from remote fd with a single request,
+/// 	   scattering the reply payload over the segments
+/// @param at where to read, -1 to read at the position of fd and advance it
+/// @return number of bytes read, -1 with errno set on failure
+ssize_t readRemote(int fd, const struct iovec *iov, int iovcnt, off_t at){
+	ssize_t nbyte = iovTotal(iov, iovcnt);
+	if (nbyte < 0 || takeError(fd) < 0){
+		return -1;
+	}
+	flushFile(fd);
+	if (takeError(fd) < 0){	//a flushed write failed
+		return -1;
+	}
+	struct rfile *f = fileOf(fd);
+	if (f->cached){
+		//segments are served by the block cache one after the other
+		off_t pos = at >= 0 ? at : f->pos;
+		ssize_t done = 0;
+		for (int i = 0; i < iovcnt; i++){
+			ssize_t res = cachedRead(fd, f, iov[i].iov_base, iov[i].iov_len, pos);
+			if (res < 0){
+				done = done > 0 ? done : -1;
+				break;
+			}
+			done += res;
+			pos += res;
+			if ((size_t)res < iov[i].iov_len){
+				break;
+			}
+		}
+		if (at < 0 && done > 0){
+			f->pos = pos;
+		}
+		return done;
+	}
+	if (viaAgent && (size_t)nbyte > AGENTMAXLEN){
+		return agentSplit(OP_READ, fd, iov, iovcnt, nbyte, at);
+	}
+	off_t off = at >= 0 ? at : f->tracked ? f->pos : -1;
+	ssize_t striped = stripedTransfer(OP_PREAD, fd, iov, iovcnt, nbyte, off);
+	if (striped != -2){
+		if (at < 0 && striped > 0){
+			f->pos += striped;
+		}
+		return striped;
+	}
+	char buff[sizeof(int) + sizeof(size_t) + sizeof(off_t)];
+	int cnt = marshallPread(buff, fd, nbyte, off);
+	if (off < 0){
+		cnt -= sizeof(off_t);	//a read at the server's offset of the fd
+	}
+	char hdr[sizeof(ssize_t)+sizeof(int)];
+	ssize_t rest = callServer(off >= 0 ? OP_PREAD : OP_READ, buff, cnt, hdr, sizeof(hdr));
+	ssize_t res = *(ssize_t*)hdr;
+	int err = *(int*)(hdr+sizeof(ssize_t));
+	if (res < 0){
+		errno = err;
+		return res;
+	}
+	for (int i = 0; i < iovcnt && rest > 0; i++){	// data lands directly in the caller's buffers
+		size_t n = iov[i].iov_len < (size_t)rest ? iov[i].iov_len : (size_t)rest;
+		recvPayload(iov[i].iov_base, n);
+		rest -= n;
+	}
+	if (at < 0 && f->tracked){
+		f->pos += res;
+	}
+	return res;
+}
+
+/// @brief write the iovcnt segments of iov to remote fd with a single request, the
+/// 	   segments going out straight from the caller's buffers. Writes are one-way
+/// 	   when enabled, and small ones at the position of fd are held back to be coalesced
+/// @param at where to write, -1 to write at the position of fd and advance it
+/// @return number of bytes written, -1 with errno set on failure
+ssize_t writeRemote(int fd, const struct iovec *iov, int iovcnt, off_t at){
+	ssize_t nbyte = iovTotal(iov, iovcnt);
+	if (nbyte < 0 || takeError(fd) < 0){
+		return -1;
+	}
+	invalidateFile(fd);
+	struct rfile *f = fileOf(fd);
+	if (f->path){
+		attrDrop(f->path);
+	}
+	if (at < 0 && (size_t)nbyte < writeBehind && (onewayOps & (1 << OP_WRITE))){
+		//coalesce small writes, they are sent once the buffer fills or something needs them
+		while (f->wbLen + nbyte > writeBehind){
+			flushWrites(fd);	//other threads may fill the buffer again meanwhile
+		}
+		if (f->wb == NULL && (f->wb = malloc(writeBehind)) == NULL){
+			fatal();
+		}
+		if (f->wbLen == 0){
+			wbFiles++;
+			f->wbOff = f->pos;
+		}
+		for (int i = 0; i < iovcnt; i++){
+			memcpy(f->wb + f->wbLen, iov[i].iov_base, iov[i].iov_len);
+			f->wbLen += iov[i].iov_len;
+		}
+		f->pos += f->tracked ? nbyte : 0;
+		return nbyte;
+	}
+	flushWrites(fd);	//held back writes may overlap, they go first
+	if (viaAgent && (size_t)nbyte > AGENTMAXLEN){
+		return agentSplit(OP_WRITE, fd, iov, iovcnt, nbyte, at);
+	}
+	off_t off = at >= 0 ? at : f->tracked ? f->pos : -1;
+	ssize_t striped = stripedTransfer(OP_PWRITE, fd, iov, iovcnt, nbyte, off);
+	if (striped != -2){
+		if (at < 0 && striped > 0){
+			f->pos += striped;
+		}
+		return striped;
+	}
+	char buff[sizeof(int) + sizeof(size_t) + sizeof(off_t)];	//marshalled fields only, the payload stays in iov
+	int cnt;
+	int op = marshallWrite(buff, &cnt, fd, nbyte, off);
+	struct iovec params[iovcnt+1];
+	params[0].iov_base = buff;
+	params[0].iov_len = cnt;
+	memcpy(params+1, iov, iovcnt*sizeof(struct iovec));
+	int advance = at < 0 && f->tracked;
+	if (sendOneway(op, fd, params, iovcnt+1)){
+		f->pos += advance ? nbyte : 0;	//a failure is reported by a later call
+		return nbyte;
+	}
+	char hdr[sizeof(ssize_t)+sizeof(int)];
+	callServerv(op, params, iovcnt+1, hdr, sizeof(hdr));
+    ssize_t res = *(ssize_t*)hdr;
+    int err = *(int*)(hdr+sizeof(ssize_t));
+    if (res == -1){
+        errno = err;
+    }else if (advance){
+		f->pos += res;
+	}
+	return res;
+}
+
+/// @brief run a transfer of more than AGENTMAXLEN bytes as a series of requests of at
+/// 	   most AGENTMAXLEN bytes each, because the agent holds every frame it relays in memory
+/// @param op OP_READ or OP_WRITE (as readRemote / writeRemote), or OP_PREAD (as preadRemote)
+/// @param at where the transfer starts, -1 for the position of fd
+/// @return number of bytes transferred, -1 with errno set if the first request failed
+ssize_t agentSplit(int op, int fd, const struct iovec *iov, int iovcnt, size_t nbyte, off_t at){
+	size_t done = 0;
+	while (done < nbyte){
+		size_t len = nbyte - done < AGENTMAXLEN ? nbyte - done : AGENTMAXLEN;
+		struct iovec seg[iovcnt];
+		int n = iovSlice(iov, iovcnt, done, len, seg);
+		off_t pos = at >= 0 ? at + (off_t)done : -1;
+		ssize_t res = op == OP_WRITE ? writeRemote(fd, seg, n, pos)
+			: op == OP_READ ? readRemote(fd, seg, n, pos) : preadRemote(fd, seg[0].iov_base, len, pos);
+		if (res < 0){
+			return done > 0 ? (ssize_t)done : -1;
+		}
+		done += res;
+		if ((size_t)res < len){
+			break;
+		}
+	}
+	return done;
+}
+
+/// @brief look up the copy state of local fd, growing the table as needed
+/// @return state of fd, NULL if fd is beyond what the table can hold
+struct cfile *cfileOf(int fd){
+	if (fd >= FDCHUNK*FDCHUNKS){
+		return NULL;
+	}
+	while (fd >= ncfiles){
+		if ((cfiles[ncfiles / FDCHUNK] = calloc(FDCHUNK, sizeof(struct cfile))) == NULL){
+			fatal();
+		}
+		ncfiles += FDCHUNK;
+	}
+	return &cfiles[fd / FDCHUNK][fd % FDCHUNK];
+}
+
+/// @brief the copy state of local fd if it is on a copy
+/// @return state of fd, NULL if fd is not on a whole-file copy
+struct cfile *copyOf(int fd){
+	if (fd < 0 || fd >= ncfiles || cfiles[fd / FDCHUNK][fd % FDCHUNK].path == NULL){
+		return NULL;
+	}
+	return &cfiles[fd / FDCHUNK][fd % FDCHUNK];
+}
+
+/// @brief 64-bit FNV-1a hash of the n bytes at p
+unsigned long long fnv(const void *p, size_t n){
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < n; i++){
+		h = (h ^ ((const unsigned char*)p)[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+/// @brief hash of canonical path key, never 0
+unsigned long long pathHash(const char *key){
+	unsigned long long h = fnv(key, strlen(key));
+	return h ? h : 1;
+}
+
+/// @brief path in cacheDir of the copy of the path with hash h at version v
+/// @param out destination, PATH_MAX bytes
+void copyName(char *out, unsigned long long h, struct fileVersion *v){
+	snprintf(out, PATH_MAX, "%s/%016llx-%016llx", cacheDir, h, fnv(v, sizeof(*v)));
+}
+
+/// @brief ask the server for the version of path
+/// @return 0 on success, -1 with errno set on failure
+int fetchVersion(const char *path, struct fileVersion *v){
+	flushFile(-1);	//writes held back change the version
+	int n = (int)strlen(path);
+	struct iovec iov[2] = {{&n, sizeof(int)}, {(char*)path, n}};
+	char hdr[sizeof(int)*2 + sizeof(struct fileVersion)];
+	callServerv(OP_VERSION, iov, 2, hdr, sizeof(hdr));
+	int res = *(int*)hdr;
+	int err = *(int*)(hdr+sizeof(int));
+	memcpy(v, hdr+sizeof(int)*2, sizeof(struct fileVersion));
+	if (res < 0){
+		errno = err;
+	}
+	return res;
+}
+
+/// @brief remember that the server reported version v for the path with hash h
+void checkStore(unsigned long long h, struct fileVersion *v){
+	struct checked *c = &checks[h % CHECKSLOTS];
+	c->hash = h;
+	c->v = *v;
+	clock_gettime(CLOCK_MONOTONIC, &c->expires);
+	c->expires.tv_sec += attrTtl / 1000;
+	c->expires.tv_nsec += (attrTtl % 1000) * 1000000;
+	if (c->expires.tv_nsec >= 1000000000){
+		c->expires.tv_sec++;
+		c->expires.tv_nsec -= 1000000000;
+	}
+}
+
+/// @brief check whether this process validated version v of the path with hash h recently
+int checkFresh(unsigned long long h, struct fileVersion *v){
+	struct checked *c = &checks[h % CHECKSLOTS];
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return c->hash == h && memcmp(&c->v, v, sizeof(*v)) == 0
+		&& (now.tv_sec < c->expires.tv_sec || (now.tv_sec == c->expires.tv_sec && now.tv_nsec < c->expires.tv_nsec));
+}
+
+/// @brief map the index of cacheDir, creating it if needed
+/// @return 0 on success, -1 if the directory cannot hold an index
+int indexOpen(void){
+	char name[PATH_MAX];
+	snprintf(name, PATH_MAX, "%s/index", cacheDir);
+	idxFd = orig_open(name, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if (idxFd < 0){
+		return -1;
+	}
+	flock(idxFd, LOCK_EX);
+	struct stat st;
+	if (fstat(idxFd, &st) < 0 || (st.st_size < (off_t)sizeof(struct cacheIndex)
+		&& ftruncate(idxFd, sizeof(struct cacheIndex)) < 0)){
+		flock(idxFd, LOCK_UN);
+		orig_close(idxFd);
+		return -1;
+	}
+	idx = mmap(NULL, sizeof(struct cacheIndex), PROT_READ|PROT_WRITE, MAP_SHARED, idxFd, 0);
+	if (idx == MAP_FAILED){
+		idx = NULL;
+		flock(idxFd, LOCK_UN);
+		orig_close(idxFd);
+		return -1;
+	}
+	if (idx->magic != INDEXMAGIC){	//new, or of another layout: start over
+		memset(idx, 0, sizeof(struct cacheIndex));
+		idx->magic = INDEXMAGIC;
+	}
+	flock(idxFd, LOCK_UN);
+	return 0;
+}
+
+/// @brief take the writer lock of the index and mark it as being changed
+void indexLock(void){
+	flock(idxFd, LOCK_EX);
+	unsigned seq = __atomic_load_n(&idx->seq, __ATOMIC_RELAXED);
+	//an odd seq here was left by a writer that died, readers are waiting on it
+	__atomic_store_n(&idx->seq, seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/// @brief publish the changes of the index and release the writer lock
+void indexUnlock(void){
+	__atomic_store_n(&idx->seq, (idx->seq | 1) + 1, __ATOMIC_RELEASE);
+	flock(idxFd, LOCK_UN);
+}
+
+/// @brief read the slot of the path with hash h without locking
+/// @param out destination of a consistent snapshot of the slot
+/// @return 1 if the slot holds a copy of that path, 0 otherwise
+int indexLookup(unsigned long long h, struct indexSlot *out){
+	struct indexSlot *s = &idx->slot[h % INDEXSLOTS];
+	int spins = 0;
+	while (1){
+		unsigned seq = __atomic_load_n(&idx->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1){
+			if (++spins % 1024 == 0 && flock(idxFd, LOCK_EX|LOCK_NB) == 0){
+				indexUnlock();	//nobody holds the lock: its writer died halfway
+			}
+			sched_yield();
+			continue;
+		}
+		memcpy(out, s, sizeof(struct indexSlot));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&idx->seq, __ATOMIC_RELAXED) == seq){
+			return out->hash == h;
+		}
+	}
+}
+
+/// @brief record a use of the copy in the slot of h for LRU eviction. A lone
+/// 	   store needs no lock: at worst it lands on a slot that was just replaced
+void indexTouch(unsigned long long h){
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	__atomic_store_n(&idx->slot[h % INDEXSLOTS].lastUse, now.tv_sec*1000000000LL + now.tv_nsec, __ATOMIC_RELAXED);
+}
+
+/// @brief remove the copy in slot s. The caller holds the writer lock
+void slotFree(struct indexSlot *s){
+	char name[PATH_MAX];
+	if (s->hash == 0){
+		return;
+	}
+	copyName(name, s->hash, &s->v);
+	orig_unlink(name);	//a reader that has it open keeps its data
+	idx->total -= s->v.size;
+	s->hash = 0;
+}
+
+/// @brief remove the least recently used copies until need more bytes fit in cacheLimit
+void cacheEvict(long long need){
+	indexLock();
+	while (idx->total + need > cacheLimit){
+		struct indexSlot *lru = NULL;
+		for (int i = 0; i < INDEXSLOTS; i++){
+			if (idx->slot[i].hash && (lru == NULL || idx->slot[i].lastUse < lru->lastUse)){
+				lru = &idx->slot[i];
+			}
+		}
+		if (lru == NULL){
+			break;
+		}
+		slotFree(lru);
+	}
+	indexUnlock();
+}
+
+/// @brief enter the copy of version v of the path with hash h, which is in place
+/// 	   under its name, in the index. Whatever held the slot before is removed
+void indexInstall(unsigned long long h, struct fileVersion *v){
+	indexLock();
+	struct indexSlot *s = &idx->slot[h % INDEXSLOTS];
+	if (s->hash != h || memcmp(&s->v, v, sizeof(*v)) != 0){
+		slotFree(s);
+		s->v = *v;
+		s->hash = h;
+		idx->total += v->size;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	s->lastUse = now.tv_sec*1000000000LL + now.tv_nsec;
+	indexUnlock();
+}
+
+/// @brief remove the copy of the path with hash h, if there is one
+void indexDrop(unsigned long long h){
+	indexLock();
+	struct indexSlot *s = &idx->slot[h % INDEXSLOTS];
+	if (s->hash == h){
+		slotFree(s);
+	}
+	indexUnlock();
+}
+
+/// @brief download path from the server into the copy named copy and enter it in the index
+/// @param h path hash
+/// @param v version the server reported for path
+/// @return 0 on success, -1 with errno set on failure
+int fetchCopy(const char *path, unsigned long long h, const char *copy, struct fileVersion *v){
+	cacheEvict(v->size);
+	char tmp[PATH_MAX];
+	snprintf(tmp, PATH_MAX, "%s.t%d.%d", copy, (int)getpid(), privSeq++);
+	int rfd = remoteOpen(path, O_RDONLY, 0);
+	if (rfd < 0){
+		return -1;
+	}
+	int lfd = orig_open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (lfd < 0){
+		int error = errno;
+		remoteClose(rfd);
+		errno = error;
+		return -1;
+	}
+	char *buf = malloc(COPYLEN);
+	if (buf == NULL){
+		fatal();
+	}
+	struct iovec iov = {buf, COPYLEN};
+	ssize_t n;
+	int res = 0;
+	while (res == 0 && (n = readRemote(remoteFd(rfd), &iov, 1, -1)) != 0){
+		if (n < 0){
+			res = -1;
+			break;
+		}
+		for (ssize_t off = 0; off < n; ){
+			ssize_t w = orig_write(lfd, buf+off, n-off);
+			if (w < 0){
+				res = -1;
+				break;
+			}
+			off += w;
+		}
+	}
+	int error = errno;
+	free(buf);
+	remoteClose(rfd);
+	orig_close(lfd);
+	if (res < 0 || rename(tmp, copy) < 0){
+		orig_unlink(tmp);
+		errno = error;
+		return -1;
+	}
+	indexInstall(h, v);	//the copy of an older version is removed
+	return 0;
+}
+
+/// @brief send the private copy of c to the server, replacing the file there
+/// @return 0 on success, -1 with errno set on failure
+int uploadCopy(struct cfile *c){
+	int lfd = orig_open(c->priv, O_RDONLY);
+	if (lfd < 0){
+		return -1;
+	}
+	int rfd = remoteOpen(c->path, O_WRONLY|O_CREAT|O_TRUNC, c->mode);
+	if (rfd < 0){
+		int error = errno;
+		orig_close(lfd);
+		errno = error;
+		return -1;
+	}
+	char *buf = malloc(COPYLEN);
+	if (buf == NULL){
+		fatal();
+	}
+	ssize_t n;
+	int res = 0;
+	while ((n = orig_read(lfd, buf, COPYLEN)) > 0){
+		struct iovec iov = {buf, n};
+		if (writeRemote(remoteFd(rfd), &iov, 1, -1) < 0){
+			res = -1;
+			break;
+		}
+	}
+	if (n < 0){
+		res = -1;
+	}
+	int error = errno;
+	free(buf);
+	orig_close(lfd);
+	if (remoteClose(rfd) < 0){	//reports the failures of the one-way writes
+		return -1;
+	}
+	errno = error;
+	return res;
+}
+
+/// @brief open path through the whole-file cache: one version check, then the
+/// 	   application works on a local copy, downloaded only if it is not current.
+/// 	   Writable opens get a private copy that close uploads
+/// @return local fd, -1 with errno set on failure, -2 if path has to be opened remotely
+int afsOpen(const char *path, int flags, mode_t m){
+	char *key = canonicalPath(path);
+	unsigned long long h = pathHash(key);
+	struct indexSlot slot;
+	struct fileVersion v;
+	int exists = 1;
+	int cached = indexLookup(h, &slot);
+	if (cached && checkFresh(h, &slot.v)){
+		v = slot.v;	//validated by this process a moment ago
+	}else{
+		exists = fetchVersion(path, &v) == 0;
+		if (exists){
+			checkStore(h, &v);
+		}
+	}
+	if (!exists && (errno != ENOENT || !(flags & O_CREAT))){
+		free(key);
+		return -1;
+	}
+	if (exists && (!v.isReg || v.size > cacheLimit)){
+		free(key);
+		return -2;
+	}
+	if (exists && (flags & O_CREAT) && (flags & O_EXCL)){
+		free(key);
+		errno = EEXIST;
+		return -1;
+	}
+	if (!exists && (flags & O_ACCMODE) == O_RDONLY){
+		free(key);
+		return -2;	//nothing to cache yet: the server creates the file
+	}
+	char copy[PATH_MAX];
+	if (exists){
+		copyName(copy, h, &v);
+		int needed = (flags & O_ACCMODE) == O_RDONLY || !(flags & O_TRUNC);
+		//a current copy is just marked as used, anything else is downloaded
+		if (needed && cached && memcmp(&slot.v, &v, sizeof(v)) == 0){
+			indexTouch(h);
+		}else if (needed && fetchCopy(path, h, copy, &v) < 0){
+			free(key);
+			return -1;
+		}
 	}
-	if (rv<0){
-		err(1,0);			// in case something went wrong
+	int fd;
+	char *priv = NULL;
+	int dirty = 0;
+	if ((flags & O_ACCMODE) == O_RDONLY){
+		fd = orig_open(copy, flags & ~(O_CREAT|O_EXCL|O_TRUNC));
+		if (fd < 0 && errno == ENOENT && fetchCopy(path, h, copy, &v) == 0){
+			fd = orig_open(copy, flags & ~(O_CREAT|O_EXCL|O_TRUNC));	//the copy was evicted meanwhile
+		}
+	}else{
+		//writers work on a private copy, readers of the cached one never see it change
+		priv = malloc(PATH_MAX);
+		if (priv == NULL){
+			fatal();
+		}
+		snprintf(priv, PATH_MAX, "%s/%016llx.w%d.%d", cacheDir, h, (int)getpid(), privSeq++);
+		fd = orig_open(priv, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		if (fd >= 0 && exists && !(flags & O_TRUNC)){
+			int src = orig_open(copy, O_RDONLY);
+			ssize_t n = 1;
+			while (src >= 0 && (n = copy_file_range(src, NULL, fd, NULL, COPYLEN, 0)) > 0);
+			if (src < 0 || n < 0){
+				int error = errno;
+				orig_close(fd);
+				fd = -1;
+				errno = error;
+			}
+			if (src >= 0){
+				orig_close(src);
+			}
+		}
+		if (fd >= 0){
+			orig_close(fd);
+			fd = orig_open(priv, flags & ~(O_CREAT|O_EXCL|O_TRUNC));
+		}
+		if (fd < 0){
+			int error = errno;
+			orig_unlink(priv);
+			free(priv);
+			free(key);
+			errno = error;
+			return -1;
+		}
+		dirty = !exists || (flags & O_TRUNC);
 	}
-
-	int bufSize; //size of the response buffer
-	memcpy(&bufSize,size,sizeof(int));
-	char *buf = malloc(bufSize);
-	if (buf == NULL){
-		err(1,0);
+	if (fd < 0){
+		free(key);
+		return -1;
 	}
-    int maxSize = MAXMSGLEN;
-    int currlen = 0;
-    if (bufSize - currlen < MAXMSGLEN){
-        maxSize = bufSize;
-    }
-    while (currlen < bufSize){
-		rv = recv(sockfd,buf+currlen,maxSize,0);
-		if (rv<0){
-			free(buf);
-			err(1,0);			// in case something went wrong
-		}
-        currlen += rv;
-        if (bufSize - currlen < maxSize){
-            maxSize = bufSize-currlen;
-        }
-    }
-
-	return buf;
+	struct cfile *c = cfileOf(fd);
+	if (c == NULL){
+		orig_close(fd);
+		if (priv){
+			orig_unlink(priv);
+		}
+		free(priv);
+		free(key);
+		errno = EMFILE;
+		return -1;
+	}
+	c->path = key;
+	c->priv = priv;
+	c->mode = m;
+	c->dirty = dirty;
+	return fd;
 }
 
+/// @brief close local fd on a copy: a written private copy is uploaded and then
+/// 	   becomes the cached copy of the new version
+/// @return 0 if succesfully executed, -1 if an error happens
+int afsClose(int fd){
+	struct cfile slot = *cfileOf(fd);	//cleared before fd can be handed out again
+	struct cfile *c = &slot;
+	memset(cfileOf(fd), 0, sizeof(struct cfile));
+	int res = orig_close(fd);
+	int error = errno;
+	if (c->priv){
+		int installed = 0;
+		if (c->dirty){
+			if (uploadCopy(c) < 0){
+				res = -1;
+				error = errno;
+			}else{
+				struct fileVersion v;
+				char copy[PATH_MAX];
+				unsigned long long h = pathHash(c->path);
+				if (fetchVersion(c->path, &v) == 0 && v.isReg && v.size <= cacheLimit){
+					checkStore(h, &v);
+					copyName(copy, h, &v);
+					cacheEvict(v.size);
+					installed = rename(c->priv, copy) == 0;
+					if (installed){
+						indexInstall(h, &v);
+					}
+				}
+			}
+		}
+		if (!installed){
+			orig_unlink(c->priv);
+		}
+	}
+	free(c->path);
+	free(c->priv);
+	errno = error;
+	return res;
+}
 
-/// @brief interposed open function that marshall and unmarshall the 
-/// 	   request and reply packet respectively
+/// @brief interposed open function: through the whole-file cache when it is on,
+/// 	   on the server otherwise
 /// @param pathname path to the file to be opened
 /// @param flags flags for the opening file
 /// @param  modes
@@ -117,67 +2567,66 @@ int open(const char *pathname, int flags, ...) {
 		m = va_arg(a, mode_t);
 		va_end(a);
 	}
-    size_t pathLen = strlen(pathname);
-
-    size_t len = sizeof(int)*2 + pathLen + sizeof(int) + sizeof(size_t) + sizeof(mode_t);
-    char buf[len+1];
-    int fID = 0;
-    int cnt = 0;
-    memcpy(buf,&fID,sizeof(int));
-    cnt += sizeof(int);
-	int bufLen = len-sizeof(int)*2;
-	memcpy(buf+cnt,&bufLen,sizeof(int));
-	cnt += sizeof(int);
-
-    memcpy(buf+cnt,&flags,sizeof(int));
-    cnt += sizeof(int);
-    memcpy(buf+cnt, &m, sizeof(mode_t));
-    cnt += sizeof(int);
-    memcpy(buf+cnt, &pathLen, sizeof(size_t));
-    cnt += sizeof(size_t);
-    memcpy(buf+cnt,pathname,pathLen);
-	
-	char* retval = sendToServer(buf,len);
-    int res = *(int*)retval;
-    int err = *(int*)(retval+sizeof(int));
-    if (res < 0){	//check if an error happened during execution
-        errno = err;
-		free(retval);
-		return res;
-    }
-	free(retval);
-	return res+fdOffset;	//add the fdOffset to indicate the fd is generated by server
+	if (!isRemote(pathname)){
+		return orig_open(pathname, flags, m);
+	}
+	clientLock();
+	int fd = cacheDir ? afsOpen(pathname, flags, m) : -2;
+	if (fd == -2){
+		fd = remoteOpen(pathname, flags, m);
+	}
+	clientUnlock();
+	return fd;
 }
 
 
-/// @brief interposed close function that marshall and unmarshall the 
-/// 	   request and reply packet respectively
+/// @brief interposed close function: fd is closed on the server if it stands for a
+/// 	   remote fd, a written private copy is uploaded
 /// @param fd file descriptor to be closed
 /// @return 0 if succesfully executed, -1 if an error happens
 int close(int fd){
 	//check if fd is created locally or on the server
-	if (fd <= fdOffset){
+	if (remoteFd(fd) < 0){
+		if (cacheDir){
+			clientLock();
+			int res = copyOf(fd) ? afsClose(fd) : orig_close(fd);
+			clientUnlock();
+			return res;
+		}
 		return orig_close(fd);
-	}else{
-		fd -= fdOffset;
-	}
-	size_t len = sizeof(int)*3;
-    char buf[len+1];
-    int fID = 1;
-    memcpy(buf, &fID, sizeof(int));
-	int bufLen = len-sizeof(int)*2;
-	int cnt = sizeof(int);
-	memcpy(buf+cnt,&bufLen,sizeof(int));
-	cnt += sizeof(int);
-    memcpy(buf+cnt,&fd,4);
-    char* retval = sendToServer(buf,len);
-	fprintf(stderr,"close called on fd: %d\n",fd);
-    int res = *(int*)retval;
-    int err = *(int*)(retval+sizeof(int));
-    if (res < 0){
-        errno = err;
-    }
-	free(retval);
+	}
+	clientLock();
+	int res = remoteClose(fd);
+	clientUnlock();
+	return res;
+}
+
+/// @brief mark local fd as written if it is a private copy of the whole-file cache
+void localWritten(int fd){
+	if (cacheDir == NULL){
+		return;
+	}
+	clientLock();
+	struct cfile *c = copyOf(fd);
+	if (c && c->priv){
+		c->dirty = 1;
+	}
+	clientUnlock();
+}
+
+/// @brief readRemote under clientMutex, for the interposed reads
+ssize_t lockedRead(int fd, const struct iovec *iov, int iovcnt, off_t at){
+	clientLock();
+	ssize_t res = readRemote(fd, iov, iovcnt, at);
+	clientUnlock();
+	return res;
+}
+
+/// @brief writeRemote under clientMutex, for the interposed writes
+ssize_t lockedWrite(int fd, const struct iovec *iov, int iovcnt, off_t at){
+	clientLock();
+	ssize_t res = writeRemote(fd, iov, iovcnt, at);
+	clientUnlock();
 	return res;
 }
 
@@ -188,203 +2637,379 @@ int close(int fd){
 /// @param nbyte how many bytes to read
 /// @return number of bytes read from the location
 ssize_t read(int fildes, void *buf, size_t nbyte){
-	if (fildes <= fdOffset){
+	int remote = remoteFd(fildes);
+	if (remote < 0){
 		return orig_read(fildes,buf,nbyte);
-	}else{
-		fildes -= fdOffset;
 	}
-	size_t len = sizeof(int)*3 + sizeof(size_t);
-	char buff[len+1];
-	int fID = 3;
-	int cnt = 0;
-	memcpy(buff, &fID, sizeof(int));
-	cnt += sizeof(int);
-	int bufLen = len-sizeof(int)*2;
-	memcpy(buff+cnt,&bufLen,sizeof(int));
-	cnt += sizeof(int);
-	memcpy(buff+cnt, &fildes, sizeof(int));
-	cnt += sizeof(int);
-	memcpy(buff+cnt,&nbyte,sizeof(size_t));
-	char* retval = sendToServer(buff,len);
-	ssize_t res = *(ssize_t*)retval;
-	int err = *(int*)(retval+sizeof(ssize_t));
-	if (res < 0){
-		errno = err;
-	}else{
-		memcpy(buf, retval + sizeof(int)+sizeof(ssize_t), res);
+	struct iovec iov = {buf, nbyte};
+	return lockedRead(remote, &iov, 1, -1);
+}
+
+/// @brief interposed pread function: a read at offset that leaves the position of fildes alone
+/// @param fildes file descriptor to read from
+/// @param buf destination of the read buffer
+/// @param nbyte how many bytes to read
+/// @param offset where to read
+/// @return number of bytes read
+ssize_t pread(int fildes, void *buf, size_t nbyte, off_t offset){
+	int remote = remoteFd(fildes);
+	if (remote < 0){
+		return orig_pread(fildes,buf,nbyte,offset);
 	}
-	free(retval);
-	return res;
+	if (offset < 0){
+		errno = EINVAL;
+		return -1;
+	}
+	struct iovec iov = {buf, nbyte};
+	return lockedRead(remote, &iov, 1, offset);
+}
+
+/// @brief interposed readv function: the segments are filled by one read
+/// @param fildes file descriptor to read from
+/// @param iov destination segments
+/// @param iovcnt number of segments
+/// @return number of bytes read
+ssize_t readv(int fildes, const struct iovec *iov, int iovcnt){
+	int remote = remoteFd(fildes);
+	if (remote < 0){
+		return orig_readv(fildes,iov,iovcnt);
+	}
+	return lockedRead(remote, iov, iovcnt, -1);
+}
+
+/// @brief interposed preadv function: the segments are filled by one read at offset
+/// @param fildes file descriptor to read from
+/// @param iov destination segments
+/// @param iovcnt number of segments
+/// @param offset where to read
+/// @return number of bytes read
+ssize_t preadv(int fildes, const struct iovec *iov, int iovcnt, off_t offset){
+	int remote = remoteFd(fildes);
+	if (remote < 0){
+		return orig_preadv(fildes,iov,iovcnt,offset);
+	}
+	if (offset < 0){
+		errno = EINVAL;
+		return -1;
+	}
+	return lockedRead(remote, iov, iovcnt, offset);
 }
 
 /// @brief interposed write function that marshall and unmarshall the 
-/// 	   request and reply packet respectively
+/// 	   request and reply packet respectively. Writes are one-way when enabled:
+/// 	   a failure is reported by the next call on fildes
 /// @param fildes file descriptor to write to
 /// @param buf the source buffer to write to the file
 /// @param nbyte how many bytes to write
 /// @return number of bytes wrote into the file
 ssize_t write(int fildes, const void *buf, size_t nbyte){
-	if (fildes <= fdOffset){
+	int remote = remoteFd(fildes);
+	if (remote < 0){
+		localWritten(fildes);
 		return orig_write(fildes,buf,nbyte);
-	}else{
-		fildes -= fdOffset;
 	}
-    size_t len = sizeof(int)*3 + sizeof(size_t) +nbyte;
-    char buff[len+1];
-    int fID = 2;
-    int cnt = 0;
-    memcpy(buff,&fID,sizeof(int));
-    cnt += sizeof(int);
-	int bufLen = len-sizeof(int)*2;
-	memcpy(buff+cnt,&bufLen,sizeof(int));
-	cnt += sizeof(int);
-    memcpy(buff+cnt, &fildes, sizeof(int));
-    cnt += sizeof(int);
-    memcpy(buff+cnt, &nbyte, sizeof(size_t));
-    cnt += sizeof(size_t);
-    memcpy(buff+cnt,buf,nbyte);
-	char* retval = sendToServer(buff,len);
-    ssize_t res = *(ssize_t*)retval;
-    int err = *(int*)(retval+sizeof(ssize_t));
-    if (res == -1){
-        errno = err;
-    }
-	free(retval);
+	struct iovec iov = {(void*)buf, nbyte};
+	return lockedWrite(remote, &iov, 1, -1);
+}
+
+/// @brief interposed pwrite function: a write at offset that leaves the position of fildes alone
+/// @param fildes file descriptor to write to
+/// @param buf the source buffer
+/// @param nbyte how many bytes to write
+/// @param offset where to write
+/// @return number of bytes written
+ssize_t pwrite(int fildes, const void *buf, size_t nbyte, off_t offset){
+	int remote = remoteFd(fildes);
+	if (remote < 0){
+		localWritten(fildes);
+		return orig_pwrite(fildes,buf,nbyte,offset);
+	}
+	if (offset < 0){
+		errno = EINVAL;
+		return -1;
+	}
+	struct iovec iov = {(void*)buf, nbyte};
+	return lockedWrite(remote, &iov, 1, offset);
+}
+
+/// @brief interposed writev function: the segments go out as one write
+/// @param fildes file descriptor to write to
+/// @param iov source segments
+/// @param iovcnt number of segments
+/// @return number of bytes written
+ssize_t writev(int fildes, const struct iovec *iov, int iovcnt){
+	int remote = remoteFd(fildes);
+	if (remote < 0){
+		localWritten(fildes);
+		return orig_writev(fildes,iov,iovcnt);
+	}
+	return lockedWrite(remote, iov, iovcnt, -1);
+}
+
+/// @brief interposed pwritev function: the segments go out as one write at offset
+/// @param fildes file descriptor to write to
+/// @param iov source segments
+/// @param iovcnt number of segments
+/// @param offset where to write
+/// @return number of bytes written
+ssize_t pwritev(int fildes, const struct iovec *iov, int iovcnt, off_t offset){
+	int remote = remoteFd(fildes);
+	if (remote < 0){
+		localWritten(fildes);
+		return orig_pwritev(fildes,iov,iovcnt,offset);
+	}
+	if (offset < 0){
+		errno = EINVAL;
+		return -1;
+	}
+	return lockedWrite(remote, iov, iovcnt, offset);
+}
+
+/// @brief pread64 is another name of pread where off_t has 64 bits
+ssize_t pread64(int fildes, void *buf, size_t nbyte, off_t offset){
+	return pread(fildes, buf, nbyte, offset);
+}
+
+/// @brief pwrite64 is another name of pwrite where off_t has 64 bits
+ssize_t pwrite64(int fildes, const void *buf, size_t nbyte, off_t offset){
+	return pwrite(fildes, buf, nbyte, offset);
+}
+
+/// @brief fsync of local fd, which may be on a private copy of the whole-file cache
+/// @return 0 if succesfully executed, -1 if an error happens
+int copyFsync(int fd){
+	struct cfile *c = copyOf(fd);
+	if (c && c->priv && c->dirty){
+		//a private copy reaches the server now rather than at close
+		if (orig_fsync(fd) < 0 || uploadCopy(c) < 0){
+			return -1;
+		}
+		c->dirty = 0;
+		return 0;
+	}
+	return orig_fsync(fd);
+}
+
+/// @brief fsync of remote fd
+/// @return 0 if succesfully executed, -1 if an error happens
+int fsyncRemote(int fd){
+	flushWrites(fd);
+	struct iovec iov = {&fd, sizeof(int)};
+	int reply[2];
+	callServerv(OP_FSYNC, &iov, 1, reply, sizeof(reply));	//also settles all one-way writes sent before
+	if (takeError(fd) < 0){
+		return -1;
+	}
+	if (reply[0] < 0){
+		errno = reply[1];
+	}
+	return reply[0];
+}
+
+/// @brief interposed fsync function: send the writes held back for fd (or upload its
+/// 	   written private copy) and have the server flush the file to disk. Errors of
+/// 	   earlier writes on fd are reported here
+/// @param fd file descriptor to be synchronized
+/// @return 0 if succesfully executed, -1 if an error happens
+int fsync(int fd){
+	int remote = remoteFd(fd);
+	if (remote < 0){
+		if (cacheDir == NULL){
+			return orig_fsync(fd);
+		}
+		clientLock();
+		int res = copyFsync(fd);
+		clientUnlock();
+		return res;
+	}
+	clientLock();
+	int res = fsyncRemote(remote);
+	clientUnlock();
 	return res;
 }
 
-/// @brief interposed lseek function that marshall and unmarshall the 
+/// @brief lseek of a remote fd that marshall and unmarshall the 
 /// 	   request and reply packet respectively
 /// @param fd file descriptor to be modified
 /// @param offset offset to be adjusted
 /// @param whence where the offset starts
 /// @return resulting offset, as measured in bytes from the beginning of the file,
-off_t lseek(int fd, off_t offset, int whence){
-	if (fd <= fdOffset){
-		return orig_lseek(fd,offset,whence);
-	}else{
-		fd -= fdOffset;
+off_t lseekRemote(int fd, off_t offset, int whence){
+	if (takeError(fd) < 0){
+		return -1;
+	}
+	flushWrites(fd);
+	struct rfile *f = fileOf(fd);
+	if (f->tracked && (whence == SEEK_SET || whence == SEEK_CUR || (whence == SEEK_END && f->cached))){
+		//the position of a tracked fd is kept here, a read-only one knows its size too
+		off_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? f->pos : f->size;
+		if (base + offset < 0){
+			errno = EINVAL;
+			return -1;
+		}
+		f->pos = base + offset;
+		f->window = 0;
+		return f->pos;
 	}
-	size_t len = sizeof(int)*4 + sizeof(off_t);
-	char buff[len+1];
-	int fID = 4;
+	char buff[sizeof(int)*2 + sizeof(off_t)];
 	int cnt = 0;
-	memcpy(buff, &fID, sizeof(int));
-	cnt += sizeof(int);
-	int bufLen = len-sizeof(int)*2;
-	memcpy(buff+cnt,&bufLen,sizeof(int));
-	cnt += sizeof(int);
 	memcpy(buff+cnt, &fd, sizeof(int));
 	cnt += sizeof(int);
 	memcpy(buff+cnt, &offset, sizeof(off_t));
 	cnt += sizeof(off_t);
 	memcpy(buff+cnt,&whence, sizeof(int));
-	char *retval = sendToServer(buff,len);
-	off_t res = *(off_t*)retval;
-	int err = *(int*)(retval+sizeof(off_t));
+	cnt += sizeof(int);
+	char hdr[sizeof(off_t)+sizeof(int)];
+	callServer(OP_LSEEK,buff,cnt,hdr,sizeof(hdr));
+	off_t res = *(off_t*)hdr;
+	int err = *(int*)(hdr+sizeof(off_t));
     if (res < 0){
         errno = err;
-    }
-	free(retval);
+    }else if (f->tracked){
+		f->pos = res;
+		f->window = 0;
+	}
+	return res;
+}
+
+/// @brief interposed lseek function: fd is sought on the server if it stands for a remote fd
+off_t lseek(int fd, off_t offset, int whence){
+	int remote = remoteFd(fd);
+	if (remote < 0){
+		return orig_lseek(fd,offset,whence);
+	}
+	clientLock();
+	off_t res = lseekRemote(remote, offset, whence);
+	clientUnlock();
 	return res;
 }
 
 
-/// @brief  interposed stat function that marshall and unmarshall the 
+/// @brief  stat of a remote path that marshall and unmarshall the 
 /// 	   request and reply packet respectively
 /// @param path the path to the target file
 /// @param buf destination buffer for the data
 /// @return 0 if succesfully executed, -1 if an error happens
-int stat(const char *restrict path, struct stat *restrict buf){
+int statRemote(const char *restrict path, struct stat *restrict buf){
+	char *key = canonicalPath(path);
+	struct attr *a = attrTtl > 0 ? attrFind(key) : NULL;
+	if (a){
+		free(key);
+		memcpy(buf, &a->st, sizeof(struct stat));
+		if (a->res < 0){
+			errno = a->err;
+		}
+		return a->res;
+	}
+	flushFile(-1);	//the size and times must reflect the writes already made
 	int n = (int) strlen(path);
-	size_t len = sizeof(int)*3+ n + sizeof(struct stat);
-	char buff[len];
-	int fID = 5;
-	int cnt = 0;
-	memcpy(buff,&fID,sizeof(int));
-	cnt += sizeof(int);
-	int bufLen = len-sizeof(int)*2;
-	memcpy(buff+cnt,&bufLen,sizeof(int));
-	cnt += sizeof(int);
-	memcpy(buff+cnt,&n,sizeof(int));
-	cnt += sizeof(int);
-	memcpy(buff+cnt, path, n);
-	char *retval = sendToServer(buff,len);
-	int res = *(int*)retval;
-	int err = *(int*)(retval+sizeof(int));
-	memcpy(buf, retval + sizeof(int)*2, sizeof(struct stat));
+	struct iovec iov[2] = {{&n, sizeof(int)}, {(char*)path, n}};
+	char hdr[sizeof(int)*2 + sizeof(struct stat)];
+	callServerv(OP_STAT, iov, 2, hdr, sizeof(hdr));
+	int res = *(int*)hdr;
+	int err = *(int*)(hdr+sizeof(int));
+	memcpy(buf, hdr + sizeof(int)*2, sizeof(struct stat));
+	if (attrTtl > 0 && (res == 0 || err == ENOENT)){	//other failures may be transient
+		attrStore(key, res, err, buf);
+	}
+	free(key);
 	if (res < 0){
 		errno = err;
 	}
-	free(retval);
+	return res;
+}
+
+/// @brief interposed stat function: remote paths are looked up on the server
+int stat(const char *restrict path, struct stat *restrict buf){
+	if (!isRemote(path)){
+		return orig_stat(path, buf);
+	}
+	clientLock();
+	int res = statRemote(path, buf);
+	clientUnlock();
 	return res;
 }
 
 
-/// @brief interposed unlink function that marshall and unmarshall the 
-/// 	   request and reply packet respectively
+/// @brief unlink of a remote path that marshall and unmarshall the 
+/// 	   request and reply packet respectively. When unlink is enabled as 
+/// 	   one-way it reports success immediately and its failure is dropped
 /// @param path the path of the file to be unlinked
 /// @return 0 if succesfully executed, -1 if an error happens
-int unlink(const char *path){
-	size_t len = sizeof(int)*3 + strlen(path);
-	char buf[len];
-	int fID = 6;
-	int cnt = 0;
+int unlinkRemote(const char *path){
+	char *key = canonicalPath(path);
+	attrDrop(key);
+	if (cacheDir){
+		indexDrop(pathHash(key));
+		checks[pathHash(key) % CHECKSLOTS].hash = 0;
+	}
+	free(key);
 	int n = (int)strlen(path);
-	memcpy(buf, &fID, sizeof(int));
-	cnt += sizeof(int);
-	int bufLen = len-sizeof(int)*2;
-	memcpy(buf+cnt,&bufLen,sizeof(int));
-	cnt += sizeof(int);
-	memcpy(buf+cnt, &n, sizeof(int));
-	cnt += sizeof(int);
-	memcpy(buf+cnt,path, n);
-	char *retval = sendToServer(buf,len);
-	int res = *(int*)retval;
-	int err = *(int*)(retval+sizeof(int));
+	struct iovec iov[2] = {{&n, sizeof(int)}, {(char*)path, n}};
+	if (deferOneway(OP_UNLINK, -1, iov, 2)){
+		return 0;
+	}
+	int reply[2];
+	callServerv(OP_UNLINK, iov, 2, reply, sizeof(reply));
+	int res = reply[0];
+	int err = reply[1];
 	if (res == -1){
 		errno = err;
 	}
-	free(retval);
 	return res;
 }
 
-/// @brief interposed getdirentries function that marshall and unmarshall the 
+/// @brief interposed unlink function: remote paths are unlinked on the server
+int unlink(const char *path){
+	if (!isRemote(path)){
+		return orig_unlink(path);
+	}
+	clientLock();
+	int res = unlinkRemote(path);
+	clientUnlock();
+	return res;
+}
+
+/// @brief getdirentries of a remote fd that marshall and unmarshall the 
 /// 	   request and reply packet respectively
 /// @param fd directory specified by fd
 /// @param buf destination buffer to read the directory entries into
 /// @param nbytes number of bytes to read
 /// @param basep the offset to start at
 /// @return number of bytes read
-ssize_t getdirentries(int fd, char *buf, size_t nbytes , off_t *basep){
-	if (fd <= fdOffset){
-		return orig_getdirentries(fd,buf,nbytes,basep);
-	}else{
-		fd -= fdOffset;
+ssize_t getdirentriesRemote(int fd, char *buf, size_t nbytes , off_t *basep){
+	if (takeError(fd) < 0){
+		return -1;
 	}
-	size_t len = sizeof(int)*3 + sizeof(size_t) + sizeof(off_t);
-	char buff[len];
-	int fID = 7;
+	char buff[sizeof(int) + sizeof(size_t) + sizeof(off_t)];
 	int cnt = 0;
-	memcpy(buff, &fID, sizeof(int));
-	cnt += sizeof(int);
-	int bufLen = len-sizeof(int)*2;
-	memcpy(buff+cnt,&bufLen,sizeof(int));
-	cnt += sizeof(int);
 	memcpy(buff+cnt, &fd, sizeof(int));
 	cnt += sizeof(int);
 	memcpy(buff + cnt, &nbytes, sizeof(size_t));
 	cnt += sizeof(size_t);
 	memcpy(buff+cnt, basep, sizeof(off_t));
-	char *retval = sendToServer(buff,len);
-	ssize_t res = *(ssize_t*)retval;
-	int err = *(int*)(retval+sizeof(ssize_t));
+	cnt += sizeof(off_t);
+	char hdr[sizeof(ssize_t)+sizeof(int)];
+	ssize_t rest = callServer(OP_GETDIRENTRIES,buff,cnt,hdr,sizeof(hdr));
+	ssize_t res = *(ssize_t*)hdr;
+	int err = *(int*)(hdr+sizeof(ssize_t));
 	if (res == -1){
 		errno = err;
 	}else{
-		memcpy(buf,retval+sizeof(int)+sizeof(ssize_t),res);
+		recvPayload(buf, rest);
+	}
+	return res;
+}
+
+/// @brief interposed getdirentries function: remote fds are read on the server
+ssize_t getdirentries(int fd, char *buf, size_t nbytes , off_t *basep){
+	int remote = remoteFd(fd);
+	if (remote < 0){
+		return orig_getdirentries(fd,buf,nbytes,basep);
 	}
-	free(retval);
+	clientLock();
+	ssize_t res = getdirentriesRemote(remote, buf, nbytes, basep);
+	clientUnlock();
 	return res;
 }
 
@@ -408,7 +3033,7 @@ struct treeRecur deserial(char* buf){
 	int numSub = *(int*)(buf+sizeof(int));
 	char *name = malloc(nameSize+1);
 	if (name == NULL){
-        err(1,0);
+        fatal();
     }
 	memcpy(name, buf+sizeof(int)*2, nameSize);
 	name[nameSize] ='\0';
@@ -428,36 +3053,41 @@ struct treeRecur deserial(char* buf){
 	return ret;
 }
 
-/// @brief interposed getdirtree function that marshall and unmarshall the 
+/// @brief getdirtree of a remote path that marshall and unmarshall the 
 /// 	   request and reply packet respectively
-struct dirtreenode* getdirtree( const char *path ){
+struct dirtreenode* getdirtreeRemote( const char *path ){
 	int pathLen = (int) strlen(path);
-    size_t len = sizeof(int)*3 + pathLen;
-    char buf[len];
-    int fID = 8;
-    int cnt = 0;
-    memcpy(buf, &fID, sizeof(int));
-    cnt += sizeof(int);
-    int bufLen = len-sizeof(int)*2;
-    memcpy(buf+cnt,&bufLen,sizeof(int));
-    cnt += sizeof(int);
-    memcpy(buf+cnt, &pathLen, sizeof(int));
-    cnt += sizeof(int);
-    memcpy(buf+cnt, path, pathLen);
-    char *retval = sendToServer(buf,len); 
-	int error = *(int*)retval;
+	struct iovec iov[2] = {{&pathLen, sizeof(int)}, {(char*)path, pathLen}};
+	int error;
+	ssize_t rest = callServerv(OP_GETDIRTREE, iov, 2, &error, sizeof(int));
+	char *retval = malloc(rest);
+	if (retval == NULL){
+		fatal();
+	}
+	recvPayload(retval, rest);
 	if (error == 1){
-		int err = *(int*)(retval + sizeof(int));
+		int err = *(int*)retval;
 		errno = err;
 		free(retval);
 		return NULL;
 	}else{
-		struct treeRecur t = deserial(retval+sizeof(int)*2+sizeof(ssize_t));
+		struct treeRecur t = deserial(retval+sizeof(int)+sizeof(ssize_t));
 		free(retval);
 		return t.tree;
 	}
 }
 
+/// @brief interposed getdirtree function: remote paths are walked on the server
+struct dirtreenode* getdirtree( const char *path ){
+	if (!isRemote(path) && orig_getdirtree){
+		return orig_getdirtree(path);
+	}
+	clientLock();
+	struct dirtreenode *res = getdirtreeRemote(path);
+	clientUnlock();
+	return res;
+}
+
 /// @brief recursive helper function that frees each node's name and 
 /// 		list of subdirectories, then the node it self
 /// @param dt the root of the tree to be freed
@@ -478,13 +3108,211 @@ void freedirtree( struct dirtreenode* dt ){
 	return freeHelper(dt);
 }
 
-/// @brief each client only has one session with the server which is connected when the program is started
+/// @brief before a fork, while clientMutex is held across it: send the writes held back,
+/// 	   so the child does not send them again, and hand the remote fds over to a ticket
+void forkPrepare(void){
+	clientLock();
+	if (connState != C_UP){
+		return;		//no session, so no remote fds either
+	}
+	int cnt = 0;
+	int cap = 0;
+	int *fds = NULL;
+	for (int i = 0; i < FDCHUNKS; i++){
+		int *c = fdMap[i];
+		for (int j = 0; c && j < FDCHUNK; j++){
+			if (c[j] == 0){
+				continue;
+			}
+			if (cnt == cap){
+				cap = cap ? cap*2 : 64;
+				if ((fds = realloc(fds, sizeof(int) * (cap+1))) == NULL){
+					fatal();
+				}
+			}
+			fds[1 + cnt++] = c[j] - 1;
+		}
+	}
+	if (cnt > 0){
+		fds[0] = cnt;
+		char reply[sizeof(int)*2 + sizeof(unsigned long long)];
+		callServer(OP_FORK, fds, sizeof(int) * (cnt+1), reply, sizeof(reply));
+		recvDone();
+		memcpy(&forkTicket, reply+sizeof(int)*2, sizeof(unsigned long long));
+	}
+	free(fds);
+	//sending drops the lock: other threads may write meanwhile, so check again until nothing is left
+	while (wbFiles > 0 || batchLen > 0){
+		if (wbFiles > 0){
+			flushFile(-1);
+		}else{
+			flushBatch();
+		}
+	}
+}
+
+/// @brief after a fork, in the parent
+void forkParent(void){
+	forkTicket = 0;
+	clientUnlock();
+}
+
+/// @brief after a fork, in the child: drop the parent's connection and whatever was in
+/// 	   flight on it, leaving the inherited placeholders to be adopted
+void forkChild(void){
+	if (connState != C_NONE){
+		orig_close(sockfd);		//the parent's, the child connects on its first request
+		if (connState == C_UP){
+			connFree(&conn);
+		}
+		connState = C_NONE;
+	}
+	for (int i = 0; i < MAXSTRIPES; i++){	//the parent's as well
+		if (stripes[i].up){
+			stripeDrop(&stripes[i]);
+		}
+		stripes[i].busy = 0;
+	}
+	groupKey = 0;
+	viaAgent = 0;
+	sending = 0;
+	receiving = 0;
+	recvOwner = 0;
+	waiters = NULL;
+	registeredId = nextId - 1;
+	syncedId = nextId - 1;
+	pendHead = 0;
+	pendCnt = 0;
+	batchLen = 0;
+	aheadHead = 0;
+	aheadCnt = 0;
+	while (lruHead){	//including blocks that were being filled for the parent
+		blockFree(lruHead);
+	}
+	for (int i = 0; i < nfiles; i++){
+		struct rfile *f = fileOf(i);
+		f->lastOneway = 0;
+		f->err = 0;		//failures of the parent's writes are the parent's to report
+		free(f->wb);	//and so are its held-back writes
+		f->wb = NULL;
+		f->wbLen = 0;
+	}
+	wbFiles = 0;
+	for (int i = 0; i < ncfiles; i++){	//a private copy is uploaded by the parent's close alone
+		free(cfileOf(i)->priv);
+		cfileOf(i)->priv = NULL;
+	}
+	if (cacheDir){	//flock is per open file: the child needs its own to exclude the parent
+		char name[PATH_MAX];
+		snprintf(name, PATH_MAX, "%s/index", cacheDir);
+		int fd = orig_open(name, O_RDWR|O_CLOEXEC);
+		if (fd >= 0){
+			dup3(fd, idxFd, O_CLOEXEC);
+			orig_close(fd);
+		}
+	}
+	for (int i = 0; i < FDCHUNKS && adoptState == ADOPT_NONE; i++){
+		for (int j = 0; fdMap[i] && j < FDCHUNK; j++){
+			if (fdMap[i][j]){
+				adoptState = ADOPT_PENDING;
+				break;
+			}
+		}
+	}
+	pthread_cond_init(&progress, NULL);		//its waiters were threads of the parent
+	pthread_mutex_unlock(&clientMutex);
+}
+
+/// @brief take over the fds the parent handed to forkTicket into our own session, moving
+/// 	   their client side state to the new fd numbers and rebinding the placeholders.
+/// 	   A placeholder whose fd could not be adopted is made to fail with EBADF
+void adoptInherited(void){
+	int error = errno;
+	int n = 0;
+	int *pairs = NULL;		//(fd of the parent, fd of this session) pairs
+	if (forkTicket){
+		int reply[2];
+		ssize_t rest = callServer(OP_ADOPT, &forkTicket, sizeof(unsigned long long), reply, sizeof(reply));
+		if (rest > 0){
+			if ((pairs = malloc(rest)) == NULL){
+				fatal();
+			}
+			recvPayload(pairs, rest);
+		}
+		recvDone();
+		n = reply[0] > 0 && rest == (int)sizeof(int)*2*reply[0] ? reply[0] : 0;
+		forkTicket = 0;
+	}
+	int *newOf = malloc(sizeof(int) * (nfiles+1));
+	struct rfile *saved = malloc(sizeof(struct rfile) * (n+1));
+	if (newOf == NULL || saved == NULL){
+		fatal();
+	}
+	for (int i = 0; i < nfiles; i++){
+		newOf[i] = -1;
+	}
+	for (int i = 0; i < n; i++){
+		if (pairs[2*i] >= 0 && pairs[2*i] < nfiles){
+			newOf[pairs[2*i]] = pairs[2*i+1];
+		}
+	}
+	int dead = -1;
+	for (int i = 0; i < FDCHUNKS; i++){
+		for (int j = 0; fdMap[i] && j < FDCHUNK; j++){
+			int old = fdMap[i][j] - 1;
+			if (old < 0){
+				continue;
+			}
+			int local = i*FDCHUNK + j;
+			if (old < nfiles && newOf[old] >= 0){
+				fdBind(local, newOf[old]);
+				continue;
+			}
+			struct rfile *f = fileOf(old);
+			free(f->wb);
+			free(f->pre);
+			free(f->path);
+			memset(f, 0, sizeof(struct rfile));
+			if (dead < 0){
+				dead = orig_open("/dev/null", O_PATH|O_CLOEXEC);
+			}
+			dup3(dead, local, O_CLOEXEC);	//keeps the number taken, but reads and writes fail
+			fdBind(local, -1);
+		}
+	}
+	if (dead >= 0){
+		orig_close(dead);
+	}
+	//the numbers of the two sessions overlap: take all states out before putting them back
+	for (int i = 0; i < n; i++){
+		saved[i] = *fileOf(pairs[2*i]);
+	}
+	for (int i = 0; i < n; i++){
+		memset(fileOf(pairs[2*i]), 0, sizeof(struct rfile));
+	}
+	for (int i = 0; i < n; i++){
+		*fileOf(pairs[2*i+1]) = saved[i];
+	}
+	free(saved);
+	free(newOf);
+	free(pairs);
+	errno = error;
+}
+
+/// @brief each client only has one session with the server, which is connected when the first request is sent
 void _init(void) {
 	// set function pointer orig_... to point to the original open function
 	orig_open = dlsym(RTLD_NEXT, "open");
 	orig_close = dlsym(RTLD_NEXT, "close");
 	orig_read = dlsym(RTLD_NEXT, "read");
 	orig_write = dlsym(RTLD_NEXT, "write");
+	orig_pread = dlsym(RTLD_NEXT, "pread");
+	orig_pwrite = dlsym(RTLD_NEXT, "pwrite");
+	orig_readv = dlsym(RTLD_NEXT, "readv");
+	orig_writev = dlsym(RTLD_NEXT, "writev");
+	orig_preadv = dlsym(RTLD_NEXT, "preadv");
+	orig_pwritev = dlsym(RTLD_NEXT, "pwritev");
+	orig_fsync = dlsym(RTLD_NEXT, "fsync");
 	orig_lseek = dlsym(RTLD_NEXT, "lseek");
 	orig_stat = dlsym(RTLD_NEXT, "stat");
 	orig_unlink = dlsym(RTLD_NEXT, "unlink");
@@ -493,8 +3321,6 @@ void _init(void) {
 	char *serverip;
 	char *serverport;
 	unsigned short port;
-	int rv;
-	struct sockaddr_in srv;
 	serverip = getenv("server15440");
 
 	if (serverip) {
@@ -511,23 +3337,93 @@ void _init(void) {
 	}
 	port = (unsigned short)atoi(serverport);
 
-	// Create socket
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);	// TCP/IP socket
-	if (sockfd<0) err(1, 0);			// in case of error
-	
+	// path prefixes served by the server, e.g. "/data:/shared"; everything else stays local
+	char *remote = getenv("remote15440");
+	if (remote) routeInit(remote);
+
+	// ops that may be sent without waiting for their reply, e.g. "close,write,unlink" or "none"
+	char *oneway = getenv("oneway15440");
+	if (oneway) {
+		onewayOps = 0;
+		if (strstr(oneway, "close")) onewayOps |= 1 << OP_CLOSE;
+		if (strstr(oneway, "write")) onewayOps |= (1 << OP_WRITE) | (1 << OP_PWRITE);
+		if (strstr(oneway, "unlink")) onewayOps |= 1 << OP_UNLINK;
+	}
+
+	// bytes of a file returned inline by read-only opens, 0 disables it
+	char *il = getenv("inline15440");
+	if (il) inlineLen = strtoul(il, NULL, 10);
+
+	// size of the per-fd buffers coalescing small writes, 0 sends every write on its own
+	char *wbs = getenv("writebehind15440");
+	if (wbs) writeBehind = strtoul(wbs, NULL, 10);
+
+	// milliseconds stat results are reused for, 0 disables the attribute cache
+	char *ttl = getenv("attrttl15440");
+	if (ttl) attrTtl = strtol(ttl, NULL, 10);
+
+	// directory for whole-file copies, and how many bytes of them it may hold
+	char *cd = getenv("cachedir15440");
+	if (cd && *cd){
+		mkdir(cd, 0700);
+		cacheDir = cd;
+		if (indexOpen() < 0){
+			cacheDir = NULL;	//no usable cache directory, everything stays remote
+		}
+	}
+	char *cl = getenv("cachelimit15440");
+	if (cl) cacheLimit = strtoll(cl, NULL, 10);
+
+	// memory for cached blocks of read-only files, 0 disables the cache and readahead
+	char *cb = getenv("cache15440");
+	if (cb) cacheBudget = strtoul(cb, NULL, 10);
+
+	// connections large reads and writes are striped over, 0 keeps them on one, and the
+	// bytes of each range
+	char *ns = getenv("stripes15440");
+	if (ns) nstripes = atoi(ns) < 0 ? 0 : atoi(ns) > MAXSTRIPES ? MAXSTRIPES : atoi(ns);
+	char *sl = getenv("stripelen15440");
+	if (sl) stripeLen = strtoul(sl, NULL, 10) < BLOCKLEN ? BLOCKLEN : strtoul(sl, NULL, 10);
+
+	// a caching agent on this host, if one runs at agent15440, relays for us
+	char *agent = getenv("agent15440");
+	if (agent && *agent && strlen(agent) < sizeof(((struct sockaddr_un*)0)->sun_path)) agentPath = agent;
+
 	// setup address structure to point to server
-	memset(&srv, 0, sizeof(srv));				// clear it first
-	srv.sin_family = AF_INET;					// IP family
-	srv.sin_addr.s_addr = inet_addr(serverip);	// IP address of server
-	srv.sin_port = htons(port);					// server port
+	memset(&srvAddr, 0, sizeof(srvAddr));				// clear it first
+	srvAddr.sin_family = AF_INET;						// IP family
+	srvAddr.sin_addr.s_addr = inet_addr(serverip);		// IP address of server
+	srvAddr.sin_port = htons(port);						// server port
 
+	// the connection is made by the first request; earlyconnect15440=1 starts it
+	// now so the handshake overlaps with the start of the application
+	char *early = getenv("earlyconnect15440");
+	if (early && atoi(early)) connectStart(1);
 
-	rv = connect(sockfd, (struct sockaddr*)&srv, sizeof(struct sockaddr));
-	if (rv<0) err(1,0);
+	// a forked child adopts the remote fds it inherits on a connection of its own
+	pthread_atfork(forkPrepare, forkParent, forkChild);
 }
 
 /// @brief the connection to the server is closed when the execution finishes
 void _fini(void){
+	if (__atomic_load_n(&exiting, __ATOMIC_ACQUIRE)){
+		return;		//the thread that failed may hold clientMutex, and the connection may be gone
+	}
+	pthread_mutex_lock(&clientMutex);	//kept: threads still running find the client gone. A child
+										//exiting before it adopted its fds leaves them to the ticket
+	for (int i = 0; i < ncfiles; i++){	//private copies still open are uploaded as by close
+		if (cfileOf(i)->priv){
+			afsClose(i);
+		}
+	}
+	flushFile(-1);	//writes held back have to reach the server before the connection goes
+	flushBatch();	//deferred closes and unlinks still have to reach the server
+	if (connState == C_NONE){
+		return;		//never needed the server
+	}
+	if (connState == C_UP && !receiving){	//a thread may still be blocked on a reply
+		connFree(&conn);
+	}
 	int rv = orig_close(sockfd);
 	if (rv < 0){
 		err(1,0);
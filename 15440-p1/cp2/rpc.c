@@ -0,0 +1,250 @@
+/*
+    Buffered framing layer used by both mylib.c and server.c. Instead of
+    pulling a message off the socket in MAXMSGLEN sized pieces, each side
+    drains whatever the kernel has queued with one large recv into a
+    per-connection buffer, and payloads at least as large as that buffer
+    are received straight into their destination.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <err.h>
+#include "rpc.h"
+
+#define MINBUFLEN (64*1024)
+#define MAXBUFLEN (4*1024*1024)
+
+/// @brief wrap the connected socket fd in c, sizing the receive buffer to the socket window
+/// @param c the connection to be initialized
+/// @param fd connected socket
+void connInit(struct conn *c, int fd){
+    int window = 0;
+    socklen_t optlen = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &window, &optlen) < 0){
+        window = MINBUFLEN;
+    }
+    size_t cap = (size_t)window;
+    if (cap < MINBUFLEN){
+        cap = MINBUFLEN;
+    }else if (cap > MAXBUFLEN){
+        cap = MAXBUFLEN;
+    }
+    c->fd = fd;
+    c->buf = malloc(cap);
+    if (c->buf == NULL){
+        err(1,0);
+    }
+    c->cap = cap;
+    c->start = 0;
+    c->end = 0;
+}
+
+/// @brief release the receive buffer of c (the socket itself is not closed)
+/// @param c the connection to be released
+void connFree(struct conn *c){
+    free(c->buf);
+    c->buf = NULL;
+    c->cap = 0;
+    c->start = 0;
+    c->end = 0;
+}
+
+/// @brief receive exactly n bytes from c into dst, first from the buffered bytes
+///        and then either directly (large remainders) or through a refill of the buffer
+/// @param c the connection to receive from
+/// @param dst destination of the bytes
+/// @param n how many bytes to receive
+/// @return 0 on success, -1 with errno set if the peer closed the connection (ECONNRESET)
+///         or an error happened
+int connRecv(struct conn *c, void *dst, size_t n){
+    char *out = dst;
+    while (n > 0){
+        size_t avail = c->end - c->start;
+        if (avail > 0){
+            size_t cnt = avail < n ? avail : n;
+            memcpy(out, c->buf + c->start, cnt);
+            c->start += cnt;
+            out += cnt;
+            n -= cnt;
+            continue;
+        }
+        ssize_t rv;
+        if (n >= c->cap){
+            // the remainder would not fit anyway, skip the extra copy
+            rv = recv(c->fd, out, n, MSG_WAITALL);
+            if (rv > 0){
+                out += rv;
+                n -= rv;
+            }
+        }else{
+            c->start = 0;
+            c->end = 0;
+            rv = recv(c->fd, c->buf, c->cap, 0);
+            if (rv > 0){
+                c->end = rv;
+            }
+        }
+        if (rv == 0){
+            errno = ECONNRESET;     //the peer is gone, report it as such
+            return -1;
+        }
+        if (rv < 0 && errno != EINTR){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// @brief receive at most n bytes from c into dst without blocking, used by event driven
+///        readers that must not stall on a connection whose request is still in flight
+/// @param c the connection to receive from
+/// @param dst destination of the bytes
+/// @param n maximum number of bytes to receive
+/// @return number of bytes received (0 if nothing is available yet), 
+///         -1 if the peer closed the connection or an error happened
+ssize_t connRecvSome(struct conn *c, void *dst, size_t n){
+    if (n == 0){
+        return 0;
+    }
+    if (c->end == c->start){
+        ssize_t rv;
+        if (n >= c->cap){
+            rv = recv(c->fd, dst, n, MSG_DONTWAIT);
+            if (rv > 0){
+                return rv;
+            }
+        }else{
+            c->start = 0;
+            c->end = 0;
+            rv = recv(c->fd, c->buf, c->cap, MSG_DONTWAIT);
+            if (rv > 0){
+                c->end = rv;
+            }
+        }
+        if (rv == 0){
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (rv < 0){
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+    }
+    size_t avail = c->end - c->start;
+    size_t cnt = avail < n ? avail : n;
+    memcpy(dst, c->buf + c->start, cnt);
+    c->start += cnt;
+    return cnt;
+}
+
+/// @brief check without blocking whether c has received bytes waiting to be consumed,
+///        either in its buffer or still in the socket
+/// @param c the connection to check
+/// @return 1 if a recv on c would not block, 0 otherwise
+int connReady(struct conn *c){
+    if (c->end > c->start){
+        return 1;
+    }
+    struct pollfd p;
+    p.fd = c->fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    return poll(&p, 1, 0) > 0;
+}
+
+/// @brief send all iovcnt segments of iov on c, resuming partial sendmsg calls
+///        so that a header and a caller's payload go out without being copied together.
+///        More than IOV_MAX segments go out over several sendmsg calls
+/// @param c the connection to send on
+/// @param iov segments to be sent (modified in place)
+/// @param iovcnt number of segments
+/// @return 0 on success, -1 if an error happened
+int connSendv(struct conn *c, struct iovec *iov, int iovcnt){
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0){
+        if (iov->iov_len == 0){ //skip empty or completed segments
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t rv = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (rv < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        while (rv > 0){
+            size_t cnt = (size_t)rv < iov->iov_len ? (size_t)rv : iov->iov_len;
+            iov->iov_base = (char*)iov->iov_base + cnt;
+            iov->iov_len -= cnt;
+            rv -= cnt;
+            if (iov->iov_len == 0){
+                iov++;
+                iovcnt--;
+            }
+        }
+    }
+    return 0;
+}
+
+/// @brief send as much of the iovcnt segments of iov on c as can go without blocking,
+///        for a reader that drives several connections at once. At most IOV_MAX
+///        segments go out per call
+/// @param c the connection to send on
+/// @param iov segments to be sent (modified in place, completed segments are left empty)
+/// @param iovcnt number of segments
+/// @return 1 if bytes are left to send, 0 once everything was sent, -1 if an error happened
+int connSendvSome(struct conn *c, struct iovec *iov, int iovcnt){
+    while (iovcnt > 0 && iov->iov_len == 0){
+        iov++;
+        iovcnt--;
+    }
+    if (iovcnt == 0){
+        return 0;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+    ssize_t rv = sendmsg(c->fd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+    if (rv < 0){
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 1 : -1;
+    }
+    while (rv > 0){
+        size_t cnt = (size_t)rv < iov->iov_len ? (size_t)rv : iov->iov_len;
+        iov->iov_base = (char*)iov->iov_base + cnt;
+        iov->iov_len -= cnt;
+        rv -= cnt;
+        if (iov->iov_len == 0){
+            iov++;
+            iovcnt--;
+        }
+    }
+    while (iovcnt > 0 && iov->iov_len == 0){
+        iov++;
+        iovcnt--;
+    }
+    return iovcnt > 0;
+}
+
+/// @brief send the n bytes of buf on c
+/// @param c the connection to send on
+/// @param buf bytes to be sent
+/// @param n number of bytes
+/// @return 0 on success, -1 if an error happened
+int connSend(struct conn *c, const void *buf, size_t n){
+    struct iovec iov;
+    iov.iov_base = (void*)buf;
+    iov.iov_len = n;
+    return connSendv(c, &iov, 1);
+}
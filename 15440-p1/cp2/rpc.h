@@ -0,0 +1,147 @@
+#ifndef __RPC_H__
+#define __RPC_H__
+
+/*
+	Framing layer shared by the client stub library and the server. Every
+	socket is wrapped in a conn which owns a receive buffer sized to the
+	socket's receive window, so that small header fields are served from
+	memory and large payloads are pulled off the socket with a few big recv calls.
+*/
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/// @brief operation codes carried in the op field of a request
+enum {
+    OP_OPEN = 0,
+    OP_CLOSE = 1,
+    OP_WRITE = 2,
+    OP_READ = 3,
+    OP_LSEEK = 4,
+    OP_STAT = 5,
+    OP_UNLINK = 6,
+    OP_GETDIRENTRIES = 7,
+    OP_GETDIRTREE = 8,
+    OP_COMPOUND = 9,    // an ordered list of requests, served in one pass with one reply
+    OP_PREAD = 10,      // read at an explicit offset, leaving the fd's offset alone
+    OP_FSYNC = 11,
+    OP_VERSION = 12,    // the fileVersion of a path, to validate a cached copy
+    OP_PWRITE = 13,     // write at an explicit offset, leaving the fd's offset alone
+    OP_FORK = 14,       // hand fds of the session over to a ticket, for a forked child
+    OP_ADOPT = 15,      // take over the fds of a ticket into the session
+    OP_JOIN = 16,       // share the fds of another connection's session, for striping
+};
+
+/// @brief an OP_FORK carries a count (int) and that many fds (int) of the session. The
+///         server holds duplicates of them under a random ticket (unsigned long long,
+///         after the result and errno of the reply), so a forked child can take them
+///         over on its own session with OP_ADOPT even after the parent closed its fds.
+///         An OP_ADOPT carries the ticket; its reply holds the count (-1 on failure) and
+///         errno, followed by an (fd of the parent, fd of this session) pair per fd
+#define TICKETTTL 60    // seconds a ticket is kept for a child that never adopts it
+
+/// @brief an OP_JOIN carries a key (unsigned long long). Key 0 asks for the key of the
+///         session's group, which comes back after the result and errno of the reply.
+///         Any other key moves the session into the group holding that key, after which
+///         it may use every fd of the group: a client stripes large transfers over
+///         several connections that all work on the fds of its first one
+
+/// @brief most bytes of data a client reads or writes through the agent in one request:
+///        the agent holds every frame it relays in memory, so clients split larger
+///        transfers, and the agent ends a client whose request is longer than this
+///        plus AGENTSLACK
+#define AGENTMAXLEN (64*1024*1024)
+#define AGENTSLACK (64*1024)    // room for the parameters in front of the data
+
+/// @brief fd value a sub-request of a compound uses to name the fd returned by the
+///        latest open earlier in the same compound
+#define FD_PREV (-2)
+
+/// @brief header in front of every request. Protocol version 2 tags each request
+///        with an id that is echoed in its reply, so a client may have several
+///        requests in flight and match the replies. Version 3 widens the lengths to
+///        64 bits, so a single read or write is not limited to 2 GiB
+struct reqHdr {
+    int op;
+    long long len;      // bytes of parameters following the header
+    unsigned id;
+    int flags;          // RPC_* request flags
+};
+
+/// @brief header in front of every reply
+struct replyHdr {
+    long long len;           // bytes of results following the header
+    unsigned id;        // id of the request this reply belongs to
+};
+
+#define RPC_VERSION 3
+
+/// @brief what identifies the contents of a file: any change to it changes at least
+///        one field, so a cached copy with an equal version is current
+struct fileVersion {
+    long long mtime;    // nanoseconds
+    long long size;
+    unsigned long long dev;
+    unsigned long long ino;
+    int isReg;          // regular file; other kinds are never cached
+};
+
+/// @brief the client does not wait for this request: the server only replies
+///        if it failed, and the client reports that error on a later call
+#define RPC_ONEWAY 1
+
+/// @brief a read that is only served if its fd is a regular file (fails with EAGAIN
+///        otherwise), for speculative reads that must not consume a pipe or device
+#define RPC_REGONLY 2
+
+/// @brief an open that carries the most bytes the client wants inline (size_t, after
+///        the path). The reply then also holds the file size (off_t, -1 unless a
+///        regular file), the file's identity (dev_t, ino_t) and its mtime (long long
+///        nanoseconds), followed, for a read-only open, by up to that many bytes of
+///        the file's head. The fd's offset is left behind the inline bytes
+#define RPC_INLINE 4
+
+/// @brief a buffered connection: bytes in buf[start, end) have been received
+///        from fd but not yet consumed
+struct conn {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+};
+
+/// @brief wrap the connected socket fd in c, sizing the receive buffer to the socket window
+void connInit(struct conn *c, int fd);
+
+/// @brief release the receive buffer of c (the socket itself is not closed)
+void connFree(struct conn *c);
+
+/// @brief receive exactly n bytes from c into dst
+/// @return 0 on success, -1 if the peer closed the connection or an error happened
+int connRecv(struct conn *c, void *dst, size_t n);
+
+/// @brief receive at most n bytes from c into dst without blocking
+/// @return number of bytes received (0 if nothing is available yet), 
+///         -1 if the peer closed the connection or an error happened
+ssize_t connRecvSome(struct conn *c, void *dst, size_t n);
+
+/// @brief check without blocking whether c has received bytes waiting to be consumed
+/// @return 1 if a recv on c would not block, 0 otherwise
+int connReady(struct conn *c);
+
+/// @brief send all iovcnt segments of iov on c with as few sendmsg calls as possible
+///        (iov is consumed in place while partial sends are resumed)
+/// @return 0 on success, -1 if an error happened
+int connSendv(struct conn *c, struct iovec *iov, int iovcnt);
+
+/// @brief send as much of the iovcnt segments of iov on c as can go without blocking
+///        (iov is consumed in place, as by connSendv)
+/// @return 1 if bytes are left to send, 0 once everything was sent, -1 if an error happened
+int connSendvSome(struct conn *c, struct iovec *iov, int iovcnt);
+
+/// @brief send the n bytes of buf on c
+/// @return 0 on success, -1 if an error happened
+int connSend(struct conn *c, const void *buf, size_t n);
+
+#endif
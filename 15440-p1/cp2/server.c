@@ -7,6 +7,8 @@
     from the function call, and the reply packet is then sent back to the client.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -20,15 +22,106 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <dirent.h>
 #include "../include/dirtree.h"
 #include <errno.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/sysmacros.h>
+#include <sys/random.h>
+#include <time.h>
+#include <limits.h>
 #include <string.h>
+#include "rpc.h"
+#include "uring.h"
 
 #define MAXMSGLEN 200
+#define CHUNKLEN (64*1024)
+#define MAXBODY (64*1024*1024)      // largest request body held in memory
+#define MAXBUFFERED (1024*1024)     // most bytes a read through a buffer returns at once
+#define PIPELEN (1024*1024)         // window of the pipe write payloads are spliced through
+#define MAXEVENTS 64
+#define MINWORKERS 4
+#define RINGENTRIES 8
+#define MAXTICKETS 1024
 
 int sockfd = 0;
+int epfd = 0;
+
+/// @brief where a session is in receiving its next request
+enum {
+    S_HDR,      // waiting for the reqHdr frame header
+    S_BODY,     // waiting for the bufSize bytes of parameters
+};
+
+/// @brief state of one client session. A session is owned either by the event loop
+///         (armed with EPOLLONESHOT) or by exactly one worker, never by both
+struct session {
+    struct conn c;
+    int state;
+    struct reqHdr hdr;
+    size_t got;             // bytes of hdr or body received so far
+    int op;
+    long long bufSize;
+    long long streamLen;    // payload of a large write left on the connection, received
+                            // in chunks by the worker serving it
+    unsigned id;            // id and flags of the request being served
+    int flags;
+    char *body;
+    struct group *g;        // the fds the session may use
+    int batching;           // replies are collected in out while serving a compound
+    int broken;             // a reply could not be sent whole, the session has to end
+    char *out;
+    size_t outLen;
+    size_t outCap;
+    struct session *next;   // link in the work queue
+};
+
+/// @brief fds opened by the sessions of one client. A session starts out in a group
+///         of its own; the connections a client stripes transfers over join the group
+///         of its first one, so they are served by different workers at once
+struct group {
+    pthread_mutex_t lock;
+    char *owned;            // owned[fd] is set if fd was opened in the group
+    int nowned;
+    int refs;               // sessions in the group
+    unsigned long long key; // what a session presents to join, 0 until asked for
+    struct group *next;     // link in groups once it has a key
+};
+
+struct group *groups = NULL;
+pthread_mutex_t groupLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// @brief requests waiting for a worker thread
+struct session *qhead = NULL;
+struct session *qtail = NULL;
+pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
+
+/// @brief fds handed over by an OP_FORK, waiting for the forked child to adopt them.
+///         Tickets belong to no session, so the parent may end before its child adopts
+struct ticket {
+    unsigned long long id;
+    time_t expires;
+    int n;
+    int *from;              // the parent's fds
+    int *fds;               // duplicates of them, owned by the ticket
+    struct ticket *next;
+};
+
+struct ticket *tickets = NULL;  // newest first
+int ntickets = 0;
+pthread_mutex_t ticketLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// @brief I/O engine: serverengine15440=uring routes the workers' file syscalls
+///         through a per-worker io_uring
+int useUring = 0;
+int uringWarned = 0;
+__thread struct uring *ring = NULL;
+__thread char *chunkBuf = NULL;        // per-worker bounce buffer, registered with the ring
+__thread int ringBufRegistered = 0;
+__thread int splicePipe[2] = {-1, -1};  // per-worker pipe moving write payloads from socket to file
+__thread size_t pipeLen = 0;
 
 
 /// @brief a helper struct to help keep track of the current serialized buffer and its size
@@ -117,34 +210,364 @@ ret *serializeTree(struct dirtreenode* t){
     return rval;
 }
 
-/// @brief receive and combine the message sent by the client into one buffer
-/// @param sessfd session fd with the client
-/// @param buf the destination buffer of the message
-/// @param bufSize size of the message to be received
-void receiveAll(int sessfd, char *buf, int bufSize){
-    int rv;
-    int maxSize = MAXMSGLEN;
-    int currlen = 0;
-    if (bufSize < maxSize){
-        maxSize = bufSize;
-    }
-    while (currlen < bufSize){
-        rv = recv(sessfd,buf+currlen,maxSize,0);
-        currlen += rv;
+/// @brief send the reply retval (a results length followed by the results) of the
+///         request sess is serving, tagged with that request's id
+/// @param sess current session
+/// @param retval marshalled reply, starting with the length of the results
+/// @param n size of retval
+/// @param ok whether the request succeeded: successful one-way requests get no reply
+void reply(struct session *sess, char *retval, size_t n, int ok){
+    if (ok && (sess->flags & RPC_ONEWAY)){
+        return;
+    }
+    struct replyHdr h;
+    int len;
+    memcpy(&len, retval, sizeof(int));
+    h.len = len;
+    h.id = sess->id;
+    if (sess->batching){
+        size_t need = sess->outLen + sizeof(h) + n - sizeof(int);
+        if (need > sess->outCap){
+            size_t cap = sess->outCap ? sess->outCap : MAXMSGLEN;
+            while (cap < need){
+                cap *= 2;
+            }
+            char *out = realloc(sess->out, cap);
+            if (out == NULL){
+                err(1,0);
+            }
+            sess->out = out;
+            sess->outCap = cap;
+        }
+        memcpy(sess->out + sess->outLen, &h, sizeof(h));
+        memcpy(sess->out + sess->outLen + sizeof(h), retval+sizeof(int), n-sizeof(int));
+        sess->outLen = need;
+        return;
+    }
+    struct iovec iov[2] = {{&h, sizeof(h)}, {retval+sizeof(int), n-sizeof(int)}};
+    if (connSendv(&sess->c, iov, 2) < 0){
+        sess->broken = 1;
+    }
+}
+
+/// @brief run the batch queued on the worker's ring and convert the result of its
+///         first entry to the syscall convention
+/// @return the result of the operation, -1 with errno set on failure
+long ringResult(void){
+    int res[2] = {0, 0};
+    if (uringRun(ring, res) < 0){
+        return -1;
+    }
+    if (res[0] < 0){
+        errno = -res[0];
+        return -1;
+    }
+    return res[0];
+}
+
+/// @brief open() through the worker's ring when the io_uring engine is active
+int ioOpen(const char *path, int flags, mode_t m){
+    if (ring == NULL || !uringSupports(ring, IORING_OP_OPENAT)){
+        return open(path, flags, m);
+    }
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)path;
+    sqe->len = m;
+    sqe->open_flags = flags;
+    return ringResult();
+}
+
+/// @brief close() through the worker's ring when the io_uring engine is active
+int ioClose(int fd){
+    if (ring == NULL || !uringSupports(ring, IORING_OP_CLOSE) || fd < 0){
+        return close(fd);
+    }
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    return ringResult();
+}
+
+/// @brief read() at the current file offset through the worker's ring when the 
+///         io_uring engine is active
+ssize_t ioRead(int fd, void *buf, size_t n){
+    if (ring == NULL || !uringSupports(ring, IORING_OP_READ) || n > INT_MAX){
+        return read(fd, buf, n);
+    }
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = n;
+    sqe->off = (__u64)-1;   //use and advance the file offset like read()
+    return ringResult();
+}
+
+/// @brief pread() through the worker's ring when it has one
+ssize_t ioPread(int fd, void *buf, size_t n, off_t off){
+    if (ring == NULL || !uringSupports(ring, IORING_OP_READ) || n > INT_MAX){
+        return pread(fd, buf, n, off);
+    }
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = n;
+    sqe->off = off;
+    return ringResult();
+}
+
+/// @brief write() at the current file offset through the worker's ring when the 
+///         io_uring engine is active
+ssize_t ioWrite(int fd, const void *buf, size_t n){
+    if (ring == NULL || !uringSupports(ring, IORING_OP_WRITE) || n > INT_MAX){
+        return write(fd, buf, n);
+    }
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = n;
+    sqe->off = (__u64)-1;
+    return ringResult();
+}
+
+/// @brief pwrite() through the worker's ring when the io_uring engine is active
+ssize_t ioPwrite(int fd, const void *buf, size_t n, off_t off){
+    if (ring == NULL || !uringSupports(ring, IORING_OP_WRITE) || n > INT_MAX){
+        return pwrite(fd, buf, n, off);
+    }
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = n;
+    sqe->off = off;
+    return ringResult();
+}
+
+/// @brief stat() through statx on the worker's ring when the io_uring engine is active
+int ioStat(const char *path, struct stat *s){
+    if (ring == NULL || !uringSupports(ring, IORING_OP_STATX)){
+        return stat(path, s);
+    }
+    struct statx x;
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)path;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (unsigned long)&x;
+    sqe->statx_flags = 0;
+    if (ringResult() < 0){
+        return -1;
+    }
+    memset(s, 0, sizeof(struct stat));
+    s->st_dev = makedev(x.stx_dev_major, x.stx_dev_minor);
+    s->st_ino = x.stx_ino;
+    s->st_mode = x.stx_mode;
+    s->st_nlink = x.stx_nlink;
+    s->st_uid = x.stx_uid;
+    s->st_gid = x.stx_gid;
+    s->st_rdev = makedev(x.stx_rdev_major, x.stx_rdev_minor);
+    s->st_size = x.stx_size;
+    s->st_blksize = x.stx_blksize;
+    s->st_blocks = x.stx_blocks;
+    s->st_atim.tv_sec = x.stx_atime.tv_sec;
+    s->st_atim.tv_nsec = x.stx_atime.tv_nsec;
+    s->st_mtim.tv_sec = x.stx_mtime.tv_sec;
+    s->st_mtim.tv_nsec = x.stx_mtime.tv_nsec;
+    s->st_ctim.tv_sec = x.stx_ctime.tv_sec;
+    s->st_ctim.tv_nsec = x.stx_ctime.tv_nsec;
+    return 0;
+}
+
+/// @brief unlink() through the worker's ring when the io_uring engine is active
+int ioUnlink(const char *path){
+    if (ring == NULL || !uringSupports(ring, IORING_OP_UNLINKAT)){
+        return unlink(path);
+    }
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)path;
+    return ringResult();
+}
+
+/// @brief fsync() through the worker's ring when the io_uring engine is active
+int ioFsync(int fd){
+    if (ring == NULL || !uringSupports(ring, IORING_OP_FSYNC)){
+        return fsync(fd);
+    }
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    return ringResult();
+}
+
+/// @brief send the n bytes of buf on the blocking socket fd, resuming partial sends
+/// @param flags extra send flags, such as MSG_MORE
+/// @return 0 on success, -1 if an error happened
+int sendAll(int fd, const void *buf, size_t n, int flags){
+    while (n > 0){
+        ssize_t rv = send(fd, buf, n, flags | MSG_NOSIGNAL);
         if (rv < 0){
-            err(1,0);
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
         }
-        if (bufSize - currlen < maxSize){
-            maxSize = bufSize-currlen;
+        buf = (const char*)buf + rv;
+        n -= rv;
+    }
+    return 0;
+}
+
+/// @brief read up to n (<= CHUNKLEN) bytes of fd into the worker's chunk buffer and send
+///         them to the client. With io_uring the two are linked submissions in the
+///         registered buffer, entering the kernel once
+/// @param off file offset to read at, -1 for the fd's current offset
+/// @return number of bytes moved, 0 at end of file, -1 if the read failed,
+///         -2 if the send failed (the session is then out of step with its client)
+ssize_t ioReadSend(int fd, int sessfd, size_t n, off_t off){
+    if (ring == NULL || !ringBufRegistered || !uringSupports(ring, IORING_OP_SEND)){
+        ssize_t got = off < 0 ? read(fd, chunkBuf, n) : pread(fd, chunkBuf, n, off);
+        if (got > 0 && sendAll(sessfd, chunkBuf, got, 0) < 0){
+            return -2;
+        }
+        return got;
+    }
+    struct io_uring_sqe *sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)chunkBuf;
+    sqe->len = n;
+    sqe->off = off < 0 ? (__u64)-1 : (__u64)off;
+    sqe->buf_index = 0;
+    sqe->flags = IOSQE_IO_LINK;     //a short read cancels the send below
+    sqe = uringSqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sessfd;
+    sqe->addr = (unsigned long)chunkBuf;
+    sqe->len = n;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    int res[2] = {0, 0};
+    if (uringRun(ring, res) < 0){
+        return -1;
+    }
+    if (res[0] < 0){
+        errno = -res[0];
+        return -1;
+    }
+    if (res[0] == 0){
+        return 0;
+    }
+    if (res[1] == res[0]){
+        return res[0];
+    }
+    if (res[1] > res[0]){
+        //the send went past what was read: the client got stale bytes of the buffer
+        errno = EIO;
+        return -2;
+    }
+    //the read came back short (or the send was cut short): finish sending what was read
+    if (res[1] < 0){
+        res[1] = 0;
+    }
+    if (sendAll(sessfd, chunkBuf + res[1], (size_t)(res[0] - res[1]), 0) < 0){
+        return -2;
+    }
+    return res[0];
+}
+
+/// @brief prepare the calling worker's chunk buffer and, when the io_uring engine was
+///         requested, its ring; falls back to plain syscalls if the kernel lacks io_uring
+void workerInit(void){
+    chunkBuf = malloc(CHUNKLEN);
+    if (chunkBuf == NULL){
+        err(1,0);
+    }
+    if (pipe2(splicePipe, O_CLOEXEC) == 0){
+        int len = fcntl(splicePipe[1], F_SETPIPE_SZ, PIPELEN);
+        pipeLen = len > 0 ? (size_t)len : (size_t)fcntl(splicePipe[1], F_GETPIPE_SZ);
+    }
+    if (!useUring){
+        return;
+    }
+    ring = malloc(sizeof(struct uring));
+    if (ring == NULL){
+        err(1,0);
+    }
+    if (uringInit(ring, RINGENTRIES) < 0){
+        free(ring);
+        ring = NULL;
+        if (__atomic_exchange_n(&uringWarned, 1, __ATOMIC_RELAXED) == 0){
+            fprintf(stderr, "io_uring unavailable, using plain syscalls\n");
         }
+        return;
     }
+    ringBufRegistered = uringRegisterBuffer(ring, chunkBuf, CHUNKLEN) == 0;
+}
+
+/// @brief reply to an RPC_INLINE open: besides the result, send the size and identity
+///         of a regular file and read the head of a read-only one straight into the
+///         reply, so small files need no read round trips at all
+/// @param sess current session
+/// @param res fd returned by the open
+/// @param openErr errno of the open
+/// @param flag flags of the open
+/// @param want most bytes the client accepts inline
+void serveOpenInline(struct session *sess, int res, int openErr, int flag, size_t want){
+    off_t size = -1;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    long long mtime = 0;
+    struct stat st;
+    if (res >= 0 && fstat(res, &st) == 0){
+        dev = st.st_dev;
+        ino = st.st_ino;
+        mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        if (S_ISREG(st.st_mode)){
+            size = st.st_size;
+        }
+    }
+    size_t n = 0;
+    if (size >= 0 && (flag & O_ACCMODE) == O_RDONLY){
+        n = (size_t)size < want ? (size_t)size : want;
+    }
+    size_t fields = sizeof(int)*3 + sizeof(off_t) + sizeof(dev_t) + sizeof(ino_t) + sizeof(long long);
+    char *retval = malloc(fields + n);
+    if (retval == NULL){
+        err(1,0);
+    }
+    size_t got = 0;
+    while (got < n){
+        ssize_t rv = ioRead(res, retval+fields+got, n-got);
+        if (rv <= 0){
+            break;  //a short head is fine, the client reads the rest normally
+        }
+        got += rv;
+    }
+    int len = fields - sizeof(int) + got;
+    memcpy(retval,&len,sizeof(int));
+    memcpy(retval+sizeof(int),&res,sizeof(int));
+    memcpy(retval+sizeof(int)*2,&openErr,sizeof(int));
+    memcpy(retval+sizeof(int)*3,&size,sizeof(off_t));
+    memcpy(retval+sizeof(int)*3+sizeof(off_t),&dev,sizeof(dev_t));
+    memcpy(retval+sizeof(int)*3+sizeof(off_t)+sizeof(dev_t),&ino,sizeof(ino_t));
+    memcpy(retval+sizeof(int)*3+sizeof(off_t)+sizeof(dev_t)+sizeof(ino_t),&mtime,sizeof(long long));
+    reply(sess, retval, fields + got, res >= 0);
+    free(retval);
 }
 
 /// @brief deserializes the parameter of open function call, execute, 
 ///         then send the serialized result back to the client
 /// @param buf the serialized buffer received from the client
-/// @param sessfd current session fd
-void serveOpen (char *buf, int sessfd){
+/// @param sess current session
+/// @return the fd opened on behalf of the client, -1 on failure
+int serveOpen (char *buf, struct session *sess){
     int flag = *(int*)(buf);
     mode_t m = *(mode_t*)(buf+sizeof(int));
     size_t pathLen = *(size_t*)(buf+sizeof(int)+sizeof(mode_t));
@@ -154,8 +577,14 @@ void serveOpen (char *buf, int sessfd){
     }
     memcpy(path,buf+sizeof(int)+sizeof(mode_t)+sizeof(size_t),pathLen);
     path[pathLen] ='\0';
-    int res = open(path,flag,m);
+    int res = ioOpen(path,flag,m);
+    int openErr = errno;
     free(path);
+    if (sess->flags & RPC_INLINE){
+        size_t want = *(size_t*)(buf+sizeof(int)+sizeof(mode_t)+sizeof(size_t)+pathLen);
+        serveOpenInline(sess, res, openErr, flag, want);
+        return res;
+    }
     char *retval = malloc(sizeof(int)*3);
     if (retval == NULL){
         err(1,0);
@@ -163,18 +592,19 @@ void serveOpen (char *buf, int sessfd){
     int len = sizeof(int)*2;
     memcpy(retval,&len,sizeof(int));
     memcpy(retval+sizeof(int),&res,sizeof(int));
-    memcpy(retval+sizeof(int)*2,&errno,sizeof(int));
-    send(sessfd, retval, 3*sizeof(int), 0);
+    memcpy(retval+sizeof(int)*2,&openErr,sizeof(int));
+    reply(sess, retval, 3*sizeof(int), res >= 0);
     free(retval);
+    return res;
 }
 
 /// @brief deserializes the parameter of close function call, execute, 
 ///         then send the serialized result back to the client
 /// @param buf the serialized buffer received from the client
-/// @param sessfd current session fd
-void serveClose(char *buf, int sessfd){
+/// @param sess current session
+void serveClose(char *buf, struct session *sess){
     int fd = *(int*)buf;
-    int res = close(fd);
+    int res = ioClose(fd);
     char *retval = malloc(sizeof(int)*3);
     if (retval == NULL){
         err(1,0);
@@ -183,22 +613,140 @@ void serveClose(char *buf, int sessfd){
     memcpy(retval, &len, sizeof(int));
     memcpy(retval+sizeof(int),&res,sizeof(int));
     memcpy(retval+sizeof(int)*2,&errno,sizeof(int));
-    send(sessfd, retval, 3*sizeof(int), 0);
+    reply(sess, retval, 3*sizeof(int), res >= 0);
     free(retval);
 }
 
 
+/// @brief write n bytes of the worker's chunk buffer to fildes
+/// @param off position to write at, NULL for the fd's offset
+/// @param done bytes of the payload written so far (advanced)
+/// @return 0 on success, an errno if the write failed or came up short
+int chunkWrite(int fildes, const off_t *off, size_t n, ssize_t *done){
+    size_t put = 0;
+    while (put < n){
+        ssize_t rv = off ? ioPwrite(fildes, chunkBuf + put, n - put, *off + *done)
+                         : ioWrite(fildes, chunkBuf + put, n - put);
+        if (rv <= 0){
+            return rv < 0 ? errno : ENOSPC;
+        }
+        put += rv;
+        *done += rv;
+    }
+    return 0;
+}
+
+/// @brief move the n bytes waiting in the worker's pipe to fildes. When the file cannot
+///         take a splice (an O_APPEND file, say) they go through the chunk buffer instead
+/// @param off position to write at, NULL for the fd's offset
+/// @param done bytes of the payload written so far (advanced)
+/// @param canSplice cleared once the file turned out not to take a splice
+/// @return 0 on success, an errno if the write failed (the pipe is emptied either way)
+int pipeWrite(int fildes, const off_t *off, size_t n, ssize_t *done, int *canSplice){
+    int error = 0;
+    while (n > 0 && !error && *canSplice){
+        loff_t pos = off ? *off + *done : 0;
+        ssize_t rv = splice(splicePipe[0], NULL, fildes, off ? &pos : NULL, n, SPLICE_F_MOVE);
+        if (rv > 0){
+            n -= rv;
+            *done += rv;
+        }else if (rv < 0 && errno == EINTR){
+            continue;
+        }else if (rv < 0 && (errno == EINVAL || errno == ENOSYS)){
+            *canSplice = 0;
+        }else{
+            error = rv < 0 ? errno : ENOSPC;
+        }
+    }
+    while (n > 0){
+        size_t cnt = n < CHUNKLEN ? n : CHUNKLEN;
+        ssize_t rv = read(splicePipe[0], chunkBuf, cnt);
+        if (rv < 0 && errno == EINTR){
+            continue;
+        }
+        if (rv <= 0){
+            err(1,0);   //the pipe is out of step with the connection
+        }
+        n -= rv;
+        if (!error){
+            error = chunkWrite(fildes, off, rv, done);
+        }
+    }
+    return error;
+}
+
+/// @brief write the payload of a large write, which was left on the connection, to
+///         fildes as it arrives. Payload bytes are spliced from the socket through the
+///         worker's pipe into the file, so they are never copied to user space and the
+///         socket keeps filling while the file is written; bytes the connection already
+///         buffered, and files that take no splice, go through the chunk buffer. After a
+///         failed write the rest of the payload is still received, so the next frame is intact
+/// @param sess current session
+/// @param fildes file to write to
+/// @param off position to write at (not advanced), NULL to write at and advance the
+///         fd's offset like write() would
+/// @param res set to the bytes written, or -1 with errno set if nothing could be written
+/// @return 0 on success, -1 if the connection broke before the payload was received
+int streamWrite(struct session *sess, int fildes, const off_t *off, ssize_t *res){
+    long long left = sess->streamLen;
+    ssize_t done = 0;
+    int error = 0;
+    int canSplice = splicePipe[0] >= 0;
+    sess->streamLen = 0;
+    while (left > 0){
+        size_t avail = sess->c.end - sess->c.start;
+        if (canSplice && !error && avail == 0){
+            size_t n = left < (long long)pipeLen ? left : pipeLen;
+            ssize_t got = splice(sess->c.fd, NULL, splicePipe[1], NULL, n, SPLICE_F_MOVE);
+            if (got > 0){
+                left -= got;
+                error = pipeWrite(fildes, off, got, &done, &canSplice);
+                continue;
+            }
+            if (got == 0){
+                return -1;
+            }
+            if (errno == EINTR){
+                continue;
+            }
+            canSplice = 0;  //not a socket splice works on: fall back to copying
+        }
+        size_t n = left < CHUNKLEN ? left : CHUNKLEN;
+        if (avail > 0 && avail < n){
+            n = avail;      //only what is buffered, the rest may be spliced
+        }
+        if (connRecv(&sess->c, chunkBuf, n) < 0){
+            return -1;
+        }
+        left -= n;
+        if (!error){
+            error = chunkWrite(fildes, off, n, &done);
+        }
+    }
+    *res = done;
+    if (done == 0 && error){
+        *res = -1;
+        errno = error;
+    }
+    return 0;
+}
+
 /// @brief deserializes the parameter of write function call, execute, 
 ///         then send the serialized result back to the client
 /// @param buf the serialized buffer received from the client
-/// @param sessfd current session fd
-void serveWrite(char* buf, int sessfd){
+/// @param sess current session
+/// @return 0 on success, -1 if the connection broke while the payload was streamed in
+int serveWrite(char* buf, struct session *sess){
     int fildes = *(int*)buf;
     size_t nbyte = *(size_t*)(buf+sizeof(int));
-    char *buff = malloc(nbyte);
-    memcpy(buff,buf+sizeof(int)+sizeof(size_t),nbyte);
-    ssize_t res = write(fildes, buff, nbyte);
-    free(buff);
+    ssize_t res;
+    if (sess->streamLen > 0){
+        if (streamWrite(sess, fildes, NULL, &res) < 0){
+            return -1;
+        }
+    }else{
+        res = ioWrite(fildes, buf+sizeof(int)+sizeof(size_t), nbyte);
+    }
     char *retval = malloc(sizeof(int)*2+sizeof(ssize_t));
     if (retval == NULL){
         err(1,0);
@@ -207,22 +755,102 @@ void serveWrite(char* buf, int sessfd){
     memcpy(retval,&len, sizeof(int));
     memcpy(retval+sizeof(int),&res,sizeof(ssize_t));
     memcpy(retval+sizeof(int)+sizeof(ssize_t),&errno,sizeof(int));
-    send(sessfd, retval, sizeof(ssize_t)+sizeof(int)*2, 0);
+    reply(sess, retval, sizeof(ssize_t)+sizeof(int)*2, res >= 0);
     free(retval);
+    return 0;
 }
 
-/// @brief deserializes the parameter of read function call, execute, 
-///         then send the serialized result + read buffer back to the client
+/// @brief deserializes the parameter of a positional write, execute, then send the
+///         serialized result back to the client. The fd's offset is not used
 /// @param buf the serialized buffer received from the client
-/// @param sessfd current session fd
-void serveRead(char *buf, int sessfd){
+/// @param sess current session
+/// @return 0 on success, -1 if the connection broke while the payload was streamed in
+int servePwrite(char* buf, struct session *sess){
     int fildes = *(int*)buf;
-    size_t nbyte = *(size_t*)(buf + sizeof(int));
-    char *buff = malloc(nbyte);
-    if (buff == NULL){
-        err(1,0);
+    size_t nbyte = *(size_t*)(buf+sizeof(int));
+    off_t off = *(off_t*)(buf+sizeof(int)+sizeof(size_t));
+    ssize_t res;
+    if (sess->streamLen > 0){
+        if (streamWrite(sess, fildes, &off, &res) < 0){
+            return -1;
+        }
+    }else{
+        res = ioPwrite(fildes, buf+sizeof(int)+sizeof(size_t)+sizeof(off_t), nbyte, off);
+    }
+    char retval[sizeof(int)*2+sizeof(ssize_t)];
+    int len = sizeof(int) + sizeof(ssize_t);
+    memcpy(retval,&len, sizeof(int));
+    memcpy(retval+sizeof(int),&res,sizeof(ssize_t));
+    memcpy(retval+sizeof(int)+sizeof(ssize_t),&errno,sizeof(int));
+    reply(sess, retval, sizeof(retval), res >= 0);
+    return 0;
+}
+
+/// @brief reply to a read of a regular file by sending the header and then letting the
+///         kernel move the file bytes to the socket with sendfile, without a user space copy
+/// @param fildes regular file to read from
+/// @param nbyte how many bytes the client asked for
+/// @param avail bytes between the read position and the end of the file
+/// @param off position to read at (advanced as bytes are sent), NULL to read at and
+///         advance the fd's offset like read() would
+/// @param sess current session
+void sendfileRead(int fildes, size_t nbyte, off_t avail, off_t *off, struct session *sess){
+    ssize_t res = avail > 0 ? (ssize_t)avail : 0;
+    if ((size_t)res > nbyte){
+        res = nbyte;
+    }
+    int sessfd = sess->c.fd;
+    char retval[sizeof(struct replyHdr)+sizeof(int)+sizeof(ssize_t)];
+    struct replyHdr h;
+    h.len = res + sizeof(ssize_t) + sizeof(int);
+    h.id = sess->id;
+    int error = 0;
+    memcpy(retval, &h, sizeof(h));
+    memcpy(retval+sizeof(h), &res, sizeof(ssize_t));
+    memcpy(retval+sizeof(h)+sizeof(ssize_t), &error, sizeof(int));
+    //nothing may follow to flush a corked header
+    if (sendAll(sessfd, retval, sizeof(retval), res > 0 ? MSG_MORE : 0) < 0){
+        sess->broken = 1;
+        return;
+    }
+    size_t left = res;
+    while (left > 0){
+        ssize_t rv = sendfile(sessfd, fildes, off, left);
+        if (rv > 0){
+            left -= rv;
+            continue;
+        }
+        if (rv < 0 && errno == EINTR){
+            continue;
+        }
+        //sendfile failed or the file shrank after the header went out: finish the
+        //promised length through the worker's chunk buffer (zero filled past the end of file)
+        size_t n = left < CHUNKLEN ? left : CHUNKLEN;
+        ssize_t got = ioReadSend(fildes, sessfd, n, off ? *off : -1);
+        if (got > 0 && off){
+            *off += got;
+        }
+        if (got == -2){
+            sess->broken = 1;
+            return;
+        }
+        if (got <= 0){
+            memset(chunkBuf, 0, n);
+            if (sendAll(sessfd, chunkBuf, n, 0) < 0){
+                sess->broken = 1;
+                return;
+            }
+            got = n;
+        }
+        left -= got;
     }
-    ssize_t res = read(fildes, buff, nbyte);
+}
+
+/// @brief send the result of a read that went through a buffer
+/// @param sess current session
+/// @param buff the bytes read
+/// @param res result of the read (errno is sent along when it failed)
+void replyRead(struct session *sess, char *buff, ssize_t res){
     if (res != -1){
         char *retval = malloc(res+sizeof(ssize_t) +sizeof(int)*2);
         if (retval == NULL){
@@ -233,7 +861,7 @@ void serveRead(char *buf, int sessfd){
         memcpy(retval+sizeof(int),&res,sizeof(ssize_t));
         memcpy(retval+sizeof(ssize_t)+sizeof(int), &errno, sizeof(int));
         memcpy(retval + sizeof(int)*2 +sizeof(size_t), buff, res);
-        send(sessfd,retval,sizeof(ssize_t)+sizeof(int)*2+res,0);
+        reply(sess,retval,sizeof(ssize_t)+sizeof(int)*2+res,1);
         free(retval);
     }else{
         char *retval = malloc(sizeof(ssize_t) +2*sizeof(int));
@@ -244,17 +872,80 @@ void serveRead(char *buf, int sessfd){
         memcpy(retval, &len, sizeof(int));
         memcpy(retval+sizeof(int),&res,sizeof(ssize_t));
         memcpy(retval+sizeof(ssize_t)+sizeof(int), &errno, sizeof(int));
-        send(sessfd,retval,sizeof(ssize_t)+2*sizeof(int),0);
+        reply(sess,retval,sizeof(ssize_t)+2*sizeof(int),0);
         free(retval);
     }
+}
+
+/// @brief deserializes the parameter of read function call, execute, 
+///         then send the serialized result + read buffer back to the client
+/// @param buf the serialized buffer received from the client
+/// @param sess current session
+void serveRead(char *buf, struct session *sess){
+    int fildes = *(int*)buf;
+    size_t nbyte = *(size_t*)(buf + sizeof(int));
+    struct stat s;
+    off_t pos;
+    int reg = fstat(fildes, &s) == 0 && S_ISREG(s.st_mode);
+    if (!reg && (sess->flags & RPC_REGONLY)){ //a speculative read must not consume a pipe or device
+        char retval[sizeof(int)*2+sizeof(ssize_t)];
+        int len = sizeof(ssize_t) + sizeof(int);
+        ssize_t res = -1;
+        int error = EAGAIN;
+        memcpy(retval, &len, sizeof(int));
+        memcpy(retval+sizeof(int), &res, sizeof(ssize_t));
+        memcpy(retval+sizeof(int)+sizeof(ssize_t), &error, sizeof(int));
+        reply(sess, retval, sizeof(retval), 0);
+        return;
+    }
+    if (reg && !sess->batching && (pos = lseek(fildes, 0, SEEK_CUR)) >= 0){
+        sendfileRead(fildes, nbyte, s.st_size - pos, NULL, sess);
+        return;
+    }
+    //not a regular file (or part of a compound reply), the size of the result is only
+    //known after reading. Returning fewer bytes than asked for is allowed here
+    if (nbyte > MAXBUFFERED){
+        nbyte = MAXBUFFERED;
+    }
+    char *buff = malloc(nbyte);
+    if (buff == NULL){
+        err(1,0);
+    }
+    ssize_t res = ioRead(fildes, buff, nbyte);
+    replyRead(sess, buff, res);
+    free(buff);
+}
+
+/// @brief deserializes the parameter of a positional read, execute, then send the
+///         serialized result + read buffer back to the client. The fd's offset is not used
+/// @param buf the serialized buffer received from the client
+/// @param sess current session
+void servePread(char *buf, struct session *sess){
+    int fildes = *(int*)buf;
+    size_t nbyte = *(size_t*)(buf + sizeof(int));
+    off_t off = *(off_t*)(buf + sizeof(int) + sizeof(size_t));
+    struct stat s;
+    if (off >= 0 && !sess->batching && fstat(fildes, &s) == 0 && S_ISREG(s.st_mode)){
+        sendfileRead(fildes, nbyte, s.st_size - off, &off, sess);
+        return;
+    }
+    if (nbyte > MAXBUFFERED){
+        nbyte = MAXBUFFERED;
+    }
+    char *buff = malloc(nbyte);
+    if (buff == NULL){
+        err(1,0);
+    }
+    ssize_t res = ioPread(fildes, buff, nbyte, off);
+    replyRead(sess, buff, res);
     free(buff);
 }
 
 /// @brief deserializes the parameter of lseek function call, execute, 
 ///         then send the serialized result back to the client
 /// @param buf the serialized buffer received from the client
-/// @param sessfd current session fd
-void serveLseek(char *buf, int sessfd){
+/// @param sess current session
+void serveLseek(char *buf, struct session *sess){
     int fildes = *(int*)buf;
     off_t offset = *(off_t*)(buf+sizeof(int));
     int pos = *(int*) (buf+sizeof(int) + sizeof(off_t));
@@ -267,7 +958,7 @@ void serveLseek(char *buf, int sessfd){
     memcpy(retval,&len,sizeof(int));
     memcpy(retval+sizeof(int),&res,sizeof(off_t));
     memcpy(retval+sizeof(off_t)+sizeof(int),&errno,sizeof(int));
-    send(sessfd,retval,sizeof(off_t)+sizeof(int)*2,0);
+    reply(sess,retval,sizeof(off_t)+sizeof(int)*2,res >= 0);
     free(retval);
 }
 
@@ -275,8 +966,8 @@ void serveLseek(char *buf, int sessfd){
 /// @brief deserializes the parameter of stat function call, execute, 
 ///         then send the serialized result back to the client
 /// @param buf the serialized buffer received from the client
-/// @param sessfd current session fd
-void serveStat(char *buf, int sessfd){
+/// @param sess current session
+void serveStat(char *buf, struct session *sess){
     int pathLen = *(int*)(buf);
     char *path = malloc(pathLen+1);
     if (path == NULL){
@@ -285,7 +976,7 @@ void serveStat(char *buf, int sessfd){
     struct stat s;
     memcpy(path,buf+sizeof(int),pathLen);
     path[pathLen] ='\0';
-    int res = stat(path,&s);
+    int res = ioStat(path,&s);
     char *retval = malloc(sizeof(int)*3+sizeof(struct stat));
     if (retval == NULL){
         err(1,0);
@@ -295,17 +986,66 @@ void serveStat(char *buf, int sessfd){
     memcpy(retval+sizeof(int),&res, sizeof(int));
     memcpy(retval + sizeof(int)*2, &errno, sizeof(int));
     memcpy(retval + sizeof(int)*3, &s, sizeof(struct stat));
-    send(sessfd,retval,sizeof(int)*3+sizeof(struct stat),0);
+    reply(sess,retval,sizeof(int)*3+sizeof(struct stat),res >= 0);
     free(path);
     free(retval);
 }
 
 
+/// @brief deserializes the path of a version check, stat it, then send the result
+///         and the fileVersion of the file back to the client
+/// @param buf the serialized buffer received from the client
+/// @param sess current session
+void serveVersion(char *buf, struct session *sess){
+    int pathLen = *(int*)(buf);
+    char *path = malloc(pathLen+1);
+    if (path == NULL){
+        err(1,0);
+    }
+    memcpy(path,buf+sizeof(int),pathLen);
+    path[pathLen] ='\0';
+    struct stat s;
+    struct fileVersion v;
+    memset(&v, 0, sizeof(v));
+    int res = ioStat(path,&s);
+    int error = errno;
+    if (res >= 0){
+        v.mtime = (long long)s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+        v.size = s.st_size;
+        v.dev = s.st_dev;
+        v.ino = s.st_ino;
+        v.isReg = S_ISREG(s.st_mode);
+    }
+    char retval[sizeof(int)*3+sizeof(struct fileVersion)];
+    int len = sizeof(int)*2 + sizeof(struct fileVersion);
+    memcpy(retval, &len, sizeof(int));
+    memcpy(retval+sizeof(int),&res, sizeof(int));
+    memcpy(retval + sizeof(int)*2, &error, sizeof(int));
+    memcpy(retval + sizeof(int)*3, &v, sizeof(struct fileVersion));
+    reply(sess,retval,sizeof(retval),res >= 0);
+    free(path);
+}
+
+/// @brief deserializes the parameter of fsync function call, execute, 
+///         then send the serialized result back to the client
+/// @param buf the serialized buffer received from the client
+/// @param sess current session
+void serveFsync(char *buf, struct session *sess){
+    int fd = *(int*)buf;
+    int res = ioFsync(fd);
+    char retval[sizeof(int)*3];
+    int len = sizeof(int)*2;
+    memcpy(retval, &len, sizeof(int));
+    memcpy(retval+sizeof(int), &res, sizeof(int));
+    memcpy(retval+sizeof(int)*2, &errno, sizeof(int));
+    reply(sess, retval, sizeof(retval), res >= 0);
+}
+
 /// @brief deserializes the parameter of unlink function call, execute, 
 ///         then send the serialized result back to the client
 /// @param buf the serialized buffer received from the client
-/// @param sessfd current session fd
-void serveUnlink(char *buf, int sessfd){
+/// @param sess current session
+void serveUnlink(char *buf, struct session *sess){
     int pathLen = *(int*)buf;
     char *path = malloc(pathLen+1);
     if (path == NULL){
@@ -313,7 +1053,7 @@ void serveUnlink(char *buf, int sessfd){
     }
     memcpy(path, buf+sizeof(int), pathLen);
     path[pathLen] = '\0';
-    int res = unlink(path);
+    int res = ioUnlink(path);
     char *retval = malloc(sizeof(int)*3);
     if (retval == NULL){
         err(1,0);
@@ -322,7 +1062,7 @@ void serveUnlink(char *buf, int sessfd){
     memcpy(retval, &len, sizeof(int));
     memcpy(retval+sizeof(int), &res, sizeof(int));
     memcpy(retval+sizeof(int)*2, &errno, sizeof(int));
-    send(sessfd,retval,sizeof(int)*3,0);
+    reply(sess,retval,sizeof(int)*3,res >= 0);
     free(path);
     free(retval);
 }
@@ -330,24 +1070,28 @@ void serveUnlink(char *buf, int sessfd){
 /// @brief deserializes the parameter of getdirentries function call, execute, 
 ///         then send the serialized result back to the client
 /// @param buf the serialized buffer received from the client
-/// @param sessfd current session fd
-void serveGetdirentries(char *buf, int sessfd){
+/// @param sess current session
+void serveGetdirentries(char *buf, struct session *sess){
     int fd = *(int*)buf;
     size_t nbyte = *(size_t*)(buf+sizeof(int));
     off_t basep;
     memcpy(&basep,buf+sizeof(int)+sizeof(size_t),sizeof(off_t));
+    if (nbyte > CHUNKLEN){
+        nbyte = CHUNKLEN;   //fewer entries per call, the client asks again
+    }
     char buff[nbyte];
     ssize_t res = getdirentries(fd, buff, nbyte, &basep);
-    char *retval = malloc(res+sizeof(int)*2+sizeof(ssize_t));
+    ssize_t n = res > 0 ? res : 0; //no payload on error
+    char *retval = malloc(n+sizeof(int)*2+sizeof(ssize_t));
     if (retval == NULL){
         err(1,0);
     }
-    int len = res+sizeof(int)+sizeof(ssize_t);
+    int len = n+sizeof(int)+sizeof(ssize_t);
     memcpy(retval, &len, sizeof(int));
     memcpy(retval+sizeof(int), &res, sizeof(ssize_t));
     memcpy(retval + sizeof(ssize_t) + sizeof(int), &errno, sizeof(int));
-    memcpy(retval + sizeof(int)*2 + sizeof(ssize_t), buff, res);
-    send(sessfd,retval,sizeof(ssize_t)+sizeof(int)*2+res,0);
+    memcpy(retval + sizeof(int)*2 + sizeof(ssize_t), buff, n);
+    reply(sess,retval,sizeof(ssize_t)+sizeof(int)*2+n,res >= 0);
     free(retval);
 }
 
@@ -355,8 +1099,8 @@ void serveGetdirentries(char *buf, int sessfd){
 /// @brief deserializes the parameter of getdirtree function call, execute, 
 ///         then send the serialized result back to the client
 /// @param buf the serialized buffer received from the client
-/// @param sessfd current session fd
-void serveGetdirtree(char *buf, int sessfd){
+/// @param sess current session
+void serveGetdirtree(char *buf, struct session *sess){
     int n = *(int*)buf;
     char path[n+1];
     memcpy(path, buf+sizeof(int), n);
@@ -369,7 +1113,7 @@ void serveGetdirtree(char *buf, int sessfd){
         memcpy(retval, &bufLen, sizeof(int));
         memcpy(retval + sizeof(int), &error, sizeof(int));
         memcpy(retval + sizeof(int)*2 , &errno, sizeof(int));
-        send(sessfd, retval, sizeof(int)*3, 0);
+        reply(sess, retval, sizeof(int)*3, 0);
     }else{
         ret *s = serializeTree(t);
         ssize_t len = (ssize_t)s->len;
@@ -382,7 +1126,7 @@ void serveGetdirtree(char *buf, int sessfd){
         memcpy(retval + sizeof(ssize_t) + sizeof(int)*2, &errno, sizeof(int));
         memcpy(retval + sizeof(int)*3 + sizeof(ssize_t), s->tmp, len);
         retval[sizeof(int)*3+sizeof(ssize_t)+len] = '\0';
-        send(sessfd,retval,s->len+sizeof(int)*3+sizeof(ssize_t)+1,0);
+        reply(sess,retval,s->len+sizeof(int)*3+sizeof(ssize_t)+1,1);
         freedirtree(t);
         free(s->tmp);
         free(s);   
@@ -390,59 +1134,566 @@ void serveGetdirtree(char *buf, int sessfd){
 }
 
 
-/// @brief serve the client 
-/// @param sessfd 
-/// @return if the current session with the client is finished (-1 indicates connection finished)
-int serve(int sessfd){
-    char op[sizeof(int)*2];
-    int rv = recv(sessfd, op, sizeof(int)*2, 0);
-    if (rv <= 0){
-        if (rv < 0){ //an unexpected error occured
+/// @brief a new group holding no fds, for a session that was just accepted
+struct group *groupNew(void){
+    struct group *g = calloc(1, sizeof(struct group));
+    if (g == NULL){
+        err(1,0);
+    }
+    pthread_mutex_init(&g->lock, NULL);
+    g->refs = 1;
+    return g;
+}
+
+/// @brief drop a session from group g, closing the fds of g once its last session ends
+void groupRelease(struct group *g){
+    pthread_mutex_lock(&groupLock);
+    int last = --g->refs == 0;
+    if (last && g->key){
+        struct group **p = &groups;
+        while (*p != g){
+            p = &(*p)->next;
+        }
+        *p = g->next;
+    }
+    pthread_mutex_unlock(&groupLock);
+    if (!last){
+        return;
+    }
+    for (int fd = 0; fd < g->nowned; fd++){
+        if (g->owned[fd]){
+            close(fd);
+        }
+    }
+    pthread_mutex_destroy(&g->lock);
+    free(g->owned);
+    free(g);
+}
+
+/// @brief record that fd was opened by session s
+void sessionAdd(struct session *s, int fd){
+    struct group *g = s->g;
+    pthread_mutex_lock(&g->lock);
+    if (fd >= g->nowned){
+        int n = g->nowned ? g->nowned : 64;
+        while (n <= fd){
+            n *= 2;
+        }
+        char *owned = realloc(g->owned, n);
+        if (owned == NULL){
             err(1,0);
         }
-        return -1;
+        memset(owned + g->nowned, 0, n - g->nowned);
+        g->owned = owned;
+        g->nowned = n;
+    }
+    g->owned[fd] = 1;
+    pthread_mutex_unlock(&g->lock);
+}
+
+/// @brief check whether fd was opened by session s, so that a client can 
+///         never operate on descriptors of another session sharing this process
+int sessionOwns(struct session *s, int fd){
+    pthread_mutex_lock(&s->g->lock);
+    int owns = fd >= 0 && fd < s->g->nowned && s->g->owned[fd];
+    pthread_mutex_unlock(&s->g->lock);
+    return owns;
+}
+
+/// @brief give up fd of session s before it is closed, in one step with the check,
+///         so that two sessions of a group never both close it
+/// @return 1 if the session owned fd
+int sessionDrop(struct session *s, int fd){
+    pthread_mutex_lock(&s->g->lock);
+    int owns = fd >= 0 && fd < s->g->nowned && s->g->owned[fd];
+    if (owns){
+        s->g->owned[fd] = 0;
+    }
+    pthread_mutex_unlock(&s->g->lock);
+    return owns;
+}
+
+/// @brief deserializes the key of an OP_JOIN: key 0 sends back the key of the group of
+///         the session, any other moves the session into the group holding that key
+/// @param buf the serialized buffer received from the client
+/// @param len size of buf
+/// @param sess current session
+void serveJoin(char *buf, int len, struct session *sess){
+    unsigned long long key = 0;
+    int res = 0;
+    int error = 0;
+    if (len >= (int)sizeof(unsigned long long)){
+        memcpy(&key, buf, sizeof(unsigned long long));
     }
-    int *fID = (int*)op;
-    int bufSize = *(fID+1);
-    char buf [bufSize];
-    receiveAll(sessfd, buf, bufSize);
-    if (*fID == 0){ //open
-        serveOpen(buf, sessfd);
-    }else if (*fID == 1){ //close
-        serveClose(buf,sessfd);
-    }else if (*fID == 2){
-        serveWrite(buf,sessfd);
-    }else if (*fID == 3){
-        serveRead(buf,sessfd);
-    }else if (*fID == 4){
-        serveLseek(buf,sessfd);
-    }else if (*fID == 5){
-        serveStat(buf,sessfd);
-    }else if (*fID == 6){
-        serveUnlink(buf,sessfd);
-    }else if (*fID == 7){
-        serveGetdirentries(buf,sessfd);
-    }else if (*fID == 8){
-        serveGetdirtree(buf, sessfd);
+    struct group *join = NULL;
+    pthread_mutex_lock(&groupLock);
+    if (key == 0){
+        struct group *g = sess->g;
+        while (g->key == 0){
+            if (getrandom(&g->key, sizeof(g->key), 0) != sizeof(g->key)){
+                err(1,0);
+            }
+            if (g->key){
+                g->next = groups;
+                groups = g;
+            }
+        }
+        key = g->key;
+    }else{
+        join = groups;
+        while (join && join->key != key){
+            join = join->next;
+        }
+        if (join){
+            join->refs++;
+        }else{
+            res = -1;
+            error = ENOENT;
+        }
+    }
+    pthread_mutex_unlock(&groupLock);
+    if (join){
+        groupRelease(sess->g);
+        sess->g = join;
+    }
+    char retval[sizeof(int)*3 + sizeof(unsigned long long)];
+    int rlen = sizeof(int)*2 + sizeof(unsigned long long);
+    memcpy(retval, &rlen, sizeof(int));
+    memcpy(retval+sizeof(int), &res, sizeof(int));
+    memcpy(retval+sizeof(int)*2, &error, sizeof(int));
+    memcpy(retval+sizeof(int)*3, &key, sizeof(unsigned long long));
+    reply(sess, retval, sizeof(retval), res >= 0);
+}
+
+/// @brief close the fds of ticket t and release it
+void ticketFree(struct ticket *t){
+    for (int i = 0; i < t->n; i++){
+        close(t->fds[i]);
+    }
+    free(t->from);
+    free(t->fds);
+    free(t);
+}
+
+/// @brief drop the tickets that expired, and the oldest ones beyond MAXTICKETS.
+///         The caller holds ticketLock
+void ticketPrune(void){
+    time_t now = time(NULL);
+    struct ticket **p = &tickets;
+    int kept = 0;
+    while (*p){
+        struct ticket *t = *p;
+        if (t->expires <= now || kept == MAXTICKETS){
+            *p = t->next;
+            ntickets--;
+            ticketFree(t);
+        }else{
+            kept++;
+            p = &t->next;
+        }
+    }
+}
+
+/// @brief deserializes the fds of an OP_FORK, duplicates the ones the session owns
+///         under a new ticket and sends the ticket back to the client
+/// @param buf the serialized buffer received from the client
+/// @param len size of buf
+/// @param sess current session
+void serveFork(char *buf, int len, struct session *sess){
+    int n = -1;
+    if (len >= (int)sizeof(int)){
+        memcpy(&n, buf, sizeof(int));
+    }
+    int res = -1;
+    int error = EINVAL;
+    unsigned long long id = 0;
+    struct ticket *t = NULL;
+    if (n >= 0 && n <= (len - (int)sizeof(int)) / (int)sizeof(int)){
+        t = calloc(1, sizeof(struct ticket));
+        if (t == NULL || (t->from = malloc(n * sizeof(int) + 1)) == NULL
+            || (t->fds = malloc(n * sizeof(int) + 1)) == NULL){
+            err(1,0);
+        }
+        while (id == 0){
+            if (getrandom(&id, sizeof(id), 0) != sizeof(id)){
+                err(1,0);
+            }
+        }
+        t->id = id;
+        t->expires = time(NULL) + TICKETTTL;
+        for (int i = 0; i < n; i++){
+            int fd;
+            memcpy(&fd, buf + sizeof(int)*(i+1), sizeof(int));
+            int dup = sessionOwns(sess, fd) ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+            if (dup >= 0){     //fds the session does not own, or out of fds: left out
+                t->from[t->n] = fd;
+                t->fds[t->n++] = dup;
+            }
+        }
+        pthread_mutex_lock(&ticketLock);
+        t->next = tickets;
+        tickets = t;
+        ntickets++;
+        ticketPrune();
+        pthread_mutex_unlock(&ticketLock);
+        res = 0;
+        error = 0;
+    }
+    char retval[sizeof(int)*3 + sizeof(unsigned long long)];
+    int rlen = sizeof(int)*2 + sizeof(unsigned long long);
+    memcpy(retval, &rlen, sizeof(int));
+    memcpy(retval+sizeof(int), &res, sizeof(int));
+    memcpy(retval+sizeof(int)*2, &error, sizeof(int));
+    memcpy(retval+sizeof(int)*3, &id, sizeof(unsigned long long));
+    reply(sess, retval, sizeof(retval), res >= 0);
+}
+
+/// @brief deserializes the ticket of an OP_ADOPT, moves its fds into the session and
+///         sends back which fd of the parent each of them stands for
+/// @param buf the serialized buffer received from the client
+/// @param len size of buf
+/// @param sess current session
+void serveAdopt(char *buf, int len, struct session *sess){
+    unsigned long long id = 0;
+    if (len >= (int)sizeof(unsigned long long)){
+        memcpy(&id, buf, sizeof(unsigned long long));
+    }
+    pthread_mutex_lock(&ticketLock);
+    ticketPrune();
+    struct ticket **p = &tickets;
+    while (*p && (*p)->id != id){
+        p = &(*p)->next;
+    }
+    struct ticket *t = *p;
+    if (t){
+        *p = t->next;
+        ntickets--;
+    }
+    pthread_mutex_unlock(&ticketLock);
+    int res = t ? t->n : -1;
+    int error = t ? 0 : ENOENT;
+    size_t n = t ? t->n : 0;
+    char *retval = malloc(sizeof(int)*3 + n*sizeof(int)*2);
+    if (retval == NULL){
+        err(1,0);
+    }
+    int rlen = sizeof(int)*2 + n*sizeof(int)*2;
+    memcpy(retval, &rlen, sizeof(int));
+    memcpy(retval+sizeof(int), &res, sizeof(int));
+    memcpy(retval+sizeof(int)*2, &error, sizeof(int));
+    for (size_t i = 0; i < n; i++){
+        sessionAdd(sess, t->fds[i]);
+        memcpy(retval + sizeof(int)*(3 + 2*i), &t->from[i], sizeof(int));
+        memcpy(retval + sizeof(int)*(4 + 2*i), &t->fds[i], sizeof(int));
+    }
+    reply(sess, retval, sizeof(int)*3 + n*sizeof(int)*2, res >= 0);
+    free(retval);
+    if (t){
+        t->n = 0;   //the fds are the session's now
+        ticketFree(t);
+    }
+}
+
+/// @brief advance the request parsing state machine of s with the bytes that can be
+///         received without blocking
+/// @param s the session to read from
+/// @return 1 if a complete request is ready in s->op / s->body, 0 if more input is
+///         needed, -1 if the client closed the connection or sent a malformed frame
+int advance(struct session *s){
+    while (1){
+        ssize_t rv;
+        if (s->state == S_HDR){
+            rv = connRecvSome(&s->c, (char*)&s->hdr + s->got, sizeof(s->hdr) - s->got);
+            if (rv <= 0){
+                return (int)rv;
+            }
+            s->got += rv;
+            if (s->got < sizeof(s->hdr)){
+                continue;
+            }
+            s->op = s->hdr.op;
+            s->bufSize = s->hdr.len;
+            s->streamLen = 0;
+            s->id = s->hdr.id;
+            s->flags = s->hdr.flags;
+            if (s->bufSize < 0){
+                return -1;
+            }
+            long long fields = sizeof(int) + sizeof(size_t);
+            if (s->op == OP_PWRITE){
+                fields += sizeof(off_t);
+            }
+            if ((s->op == OP_WRITE || s->op == OP_PWRITE) && s->bufSize > fields + CHUNKLEN){
+                //only the fields are parsed here, the worker streams the payload to the file
+                s->streamLen = s->bufSize - fields;
+                s->bufSize = fields;
+            }else if (s->bufSize > MAXBODY){
+                return -1;
+            }
+            free(s->body);
+            s->body = malloc(s->bufSize + 1);
+            if (s->body == NULL){
+                err(1,0);
+            }
+            s->got = 0;
+            s->state = S_BODY;
+        }
+        if (s->got == (size_t)s->bufSize){
+            s->got = 0;
+            s->state = S_HDR;
+            return 1;
+        }
+        rv = connRecvSome(&s->c, s->body + s->got, s->bufSize - s->got);
+        if (rv <= 0){
+            return (int)rv;
+        }
+        s->got += rv;
+    }
+}
+
+/// @brief run one operation for session s
+/// @param s the session of the client
+/// @param fID operation code
+/// @param buf marshalled parameters of the operation
+/// @param len size of buf
+/// @return the fd opened by an OP_OPEN (-1 if it failed or for other ops),
+///         -2 if the request was malformed and the session must end
+int dispatch(struct session *s, int fID, char *buf, long long len){
+    if (fID == OP_CLOSE || fID == OP_WRITE || fID == OP_READ || fID == OP_LSEEK || fID == OP_GETDIRENTRIES
+        || fID == OP_PREAD || fID == OP_PWRITE || fID == OP_FSYNC){
+        //the request names one of our fds, refuse it unless this session opened it
+        if (len < (long long)sizeof(int)){
+            return -2;
+        }
+        int fd;
+        memcpy(&fd, buf, sizeof(int));
+        if (fID == OP_CLOSE ? !sessionDrop(s, fd) : !sessionOwns(s, fd)){
+            fd = -1;    //the call fails with EBADF as for any unknown fd
+            memcpy(buf, &fd, sizeof(int));
+        }
+    }
+    if (fID == OP_OPEN){
+        int fd = serveOpen(buf, s);
+        if (fd >= 0){
+            sessionAdd(s, fd);
+        }
+        return fd;
+    }else if (fID == OP_CLOSE){
+        serveClose(buf, s);
+    }else if (fID == OP_WRITE){
+        if (serveWrite(buf, s) < 0){
+            return -2;
+        }
+    }else if (fID == OP_READ){
+        serveRead(buf, s);
+    }else if (fID == OP_PREAD){
+        servePread(buf, s);
+    }else if (fID == OP_PWRITE){
+        if (servePwrite(buf, s) < 0){
+            return -2;
+        }
+    }else if (fID == OP_FSYNC){
+        serveFsync(buf, s);
+    }else if (fID == OP_VERSION){
+        serveVersion(buf, s);
+    }else if (fID == OP_LSEEK){
+        serveLseek(buf, s);
+    }else if (fID == OP_STAT){
+        serveStat(buf, s);
+    }else if (fID == OP_UNLINK){
+        serveUnlink(buf, s);
+    }else if (fID == OP_GETDIRENTRIES){
+        serveGetdirentries(buf, s);
+    }else if (fID == OP_GETDIRTREE){
+        serveGetdirtree(buf, s);
+    }else if (fID == OP_FORK){
+        serveFork(buf, len, s);
+    }else if (fID == OP_ADOPT){
+        serveAdopt(buf, len, s);
+    }else if (fID == OP_JOIN){
+        serveJoin(buf, len, s);
     }else{
         fprintf(stderr,"undefined function \n");
-        return -1;
+        return -2;
+    }
+    return -1;
+}
+
+/// @brief run the sub-requests packed in the body of a compound request in order,
+///         collecting their replies so they go back to the client in a single send.
+///         A sub-request whose fd is FD_PREV operates on the fd returned by the
+///         latest open of the same compound
+/// @param s the session of the client
+/// @return 0 on success, -1 if the compound was malformed
+int serveCompound(struct session *s){
+    char *buf = s->body;
+    long long left = s->bufSize;
+    int prevFd = -1;
+    int rv = 0;
+    s->outLen = 0;
+    s->batching = 1;
+    while (left > 0){
+        struct reqHdr h;
+        if (left < (long long)sizeof(h)){
+            rv = -1;
+            break;
+        }
+        memcpy(&h, buf, sizeof(h));
+        buf += sizeof(h);
+        left -= sizeof(h);
+        if (h.len < 0 || h.len > left || h.op == OP_COMPOUND){
+            rv = -1;
+            break;
+        }
+        if (h.op != OP_OPEN && h.len >= (long long)sizeof(int) && *(int*)buf == FD_PREV){
+            memcpy(buf, &prevFd, sizeof(int));
+        }
+        s->id = h.id;
+        s->flags = h.flags;
+        int fd = dispatch(s, h.op, buf, h.len);
+        if (fd == -2){
+            rv = -1;
+            break;
+        }
+        if (h.op == OP_OPEN){
+            prevFd = fd;
+        }
+        buf += h.len;
+        left -= h.len;
+    }
+    s->batching = 0;
+    if (s->outLen > 0 && connSend(&s->c, s->out, s->outLen) < 0){
+        rv = -1;
+    }
+    return rv;
+}
+
+/// @brief serve the request that has been parsed into s
+/// @param s the session of the client
+/// @return if the current session with the client is finished (-1 indicates connection finished)
+int serve(struct session *s){
+    if (s->op == OP_COMPOUND){
+        return serveCompound(s) < 0 || s->broken ? -1 : 0;
+    }
+    return dispatch(s, s->op, s->body, s->bufSize) == -2 || s->broken ? -1 : 0;
+}
+
+/// @brief close every file the client left open, unless other sessions of its group
+///         still use them, and release the session
+void endSession(struct session *s){
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->c.fd, NULL);
+    groupRelease(s->g);
+    close(s->c.fd);
+    connFree(&s->c);
+    free(s->body);
+    free(s->out);
+    free(s);
+}
+
+/// @brief hand s back to the event loop to wait for its next request
+void rearm(struct session *s){
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = s;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, s->c.fd, &ev) < 0){
+        err(1,0);
+    }
+}
+
+/// @brief queue s, which holds a complete request, for the worker pool
+void enqueue(struct session *s){
+    pthread_mutex_lock(&qlock);
+    s->next = NULL;
+    if (qtail){
+        qtail->next = s;
+    }else{
+        qhead = s;
+    }
+    qtail = s;
+    pthread_cond_signal(&qcond);
+    pthread_mutex_unlock(&qlock);
+}
+
+/// @brief worker thread: runs the blocking file syscalls of queued requests, then keeps 
+///         serving requests the client already pipelined before returning the session
+///         to the event loop
+void *worker(void *arg){
+    workerInit();
+    while (1){
+        pthread_mutex_lock(&qlock);
+        while (qhead == NULL){
+            pthread_cond_wait(&qcond, &qlock);
+        }
+        struct session *s = qhead;
+        qhead = s->next;
+        if (qhead == NULL){
+            qtail = NULL;
+        }
+        pthread_mutex_unlock(&qlock);
+
+        int rv;
+        do {
+            if (serve(s) < 0){
+                rv = -1;
+                break;
+            }
+            rv = advance(s);
+        } while (rv == 1);
+        if (rv < 0){ //current client has closed connection
+            endSession(s);
+        }else{
+            rearm(s);
+        }
+    }
+    return NULL;
+}
+
+/// @brief accept every pending connection on the listening socket and register them
+///         with the event loop
+void acceptAll(void){
+    while (1){
+        struct sockaddr_in cli;
+        socklen_t sa_size = sizeof(struct sockaddr_in);
+        int sessfd = accept(sockfd, (struct sockaddr *)&cli, &sa_size);
+        if (sessfd < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE){
+                return;
+            }
+            err(1,0);
+        }
+        struct session *s = calloc(1, sizeof(struct session));
+        if (s == NULL){
+            err(1,0);
+        }
+        connInit(&s->c, sessfd);
+        s->g = groupNew();
+        s->state = S_HDR;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = s;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sessfd, &ev) < 0){
+            err(1,0);
+        }
     }
-    return 0;
 }
 
 
 int main(int argc, char**argv) {
 	char *serverport;
 	unsigned short port;
-	int sessfd, rv, i;
-	struct sockaddr_in srv, cli;
-	socklen_t sa_size;
+	int rv;
+	struct sockaddr_in srv;
 	
 	// Get environment variable indicating the port of the server
 	serverport = getenv("serverport15440");
 	if (serverport) port = (unsigned short)atoi(serverport);
 	else port=15400;
+	// Get environment variable selecting the I/O engine of the workers
+	char *engine = getenv("serverengine15440");
+	if (engine && strcmp(engine, "uring") == 0) useUring = 1;
 	// Create socket
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);	// TCP/IP socket
 	if (sockfd<0) err(1, 0);			        // in case of error
@@ -458,30 +1709,48 @@ int main(int argc, char**argv) {
 	if (rv<0) err(1,0);
 	
 	// start listening for connections
-	rv = listen(sockfd, 5);
+	rv = listen(sockfd, SOMAXCONN);
 	if (rv<0) err(1,0);
-	
-	// main server loop, handle clients one at a time
+	if (fcntl(sockfd, F_SETFL, O_NONBLOCK) < 0) err(1,0);
+
+	// a client that disconnects mid-reply must not take the whole server down
+	signal(SIGPIPE, SIG_IGN);
+
+	epfd = epoll_create1(0);
+	if (epfd<0) err(1,0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;	// NULL marks the listening socket
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) err(1,0);
+
+	long nworkers = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	if (nworkers < MINWORKERS) nworkers = MINWORKERS;
+	for (long i = 0; i < nworkers; i++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, worker, NULL) != 0) err(1,0);
+		pthread_detach(tid);
+	}
+
+	// main server loop: wait for readable sessions and parse their requests, blocking
+	// work is left to the worker pool
+	struct epoll_event events[MAXEVENTS];
 	while(1) {
-		// wait for next client, get session socket
-		sa_size = sizeof(struct sockaddr_in);
-		sessfd = accept(sockfd, (struct sockaddr *)&cli, &sa_size);
-        if (sessfd<0) err(1,0);
-        int r = fork();
-        if (r < 0){
-            err(1,0);
-        }
-        if (r == 0){
-            close(sockfd);
-            while (1){
-                if (serve(sessfd) == -1){ //current client has closed connection
-                    break;
-                }
-            }
-            close(sessfd);
-            exit(0);
-        }
-		close(sessfd);
+		int n = epoll_wait(epfd, events, MAXEVENTS, -1);
+		if (n<0) {
+			if (errno == EINTR) continue;
+			err(1,0);
+		}
+		for (int i = 0; i < n; i++) {
+			struct session *s = events[i].data.ptr;
+			if (s == NULL) {
+				acceptAll();
+				continue;
+			}
+			rv = advance(s);
+			if (rv == 1) enqueue(s);
+			else if (rv == 0) rearm(s);
+			else endSession(s);
+		}
 	}
 	// close socket
 	close(sockfd);
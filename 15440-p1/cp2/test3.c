@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// a write larger than the server holds in memory for one request (MAXBODY), sent
+// while a deferred close is batched, must still reach the file in full
+int main(int argc, char **argv) {
+    size_t n = (argc > 1 ? atol(argv[1]) : 70) * 1024 * 1024;
+    char *buf = malloc(n);
+    if (buf == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = i % 251;
+    }
+    int a = open("test3_a", O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+    int b = open("test3_b", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (a < 0 || b < 0) {
+        printf("open failed\n");
+        return 1;
+    }
+    close(b);   // deferred and batched by the client
+    ssize_t w = write(a, buf, n);
+    if (close(a) < 0 || w != (ssize_t)n) {
+        printf("write %zd of %zu\n", w, n);
+        return 1;
+    }
+    int fd = open("test3_a", O_RDONLY);
+    size_t got = 0;
+    ssize_t r;
+    memset(buf, 0, n);
+    while (got < n && (r = read(fd, buf + got, n - got)) > 0) {
+        got += r;
+    }
+    close(fd);
+    unlink("test3_a");
+    unlink("test3_b");
+    for (size_t i = 0; i < got; i++) {
+        if (buf[i] != (char)(i % 251)) {
+            printf("mismatch at %zu\n", i);
+            return 1;
+        }
+    }
+    printf("%s\n", got == n ? "test3 OK" : "test3 short");
+    return got != n;
+}
@@ -0,0 +1,6 @@
+#!/usr/bin/bash
+
+# large writes behind a batched close, with and without striping
+for opt in "" "stripes15440=0"; do
+ env ${opt} LD_PRELOAD=./mylib.so ./test3 70 || exit 1
+done
@@ -0,0 +1,177 @@
+/*
+    Thin io_uring wrapper for the server. Each worker thread owns one ring and
+    uses it synchronously: it queues a batch of (possibly linked) submissions,
+    enters the kernel once, and collects the results of the whole batch.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "uring.h"
+
+/// @brief set up a ring with room for entries submissions and map its queues
+/// @param r the ring to be initialized
+/// @param entries queue depth
+/// @return 0 on success, -1 if the kernel does not provide a usable io_uring
+int uringInit(struct uring *r, unsigned entries){
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0){
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)){ //reads/writes must be able to use the file offset
+        close(r->fd);
+        return -1;
+    }
+    r->entries = p.sq_entries;
+    r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqRing == MAP_FAILED || r->cqRing == MAP_FAILED || r->sqes == MAP_FAILED){
+        uringExit(r);
+        return -1;
+    }
+    char *sq = r->sqRing;
+    char *cq = r->cqRing;
+    r->sqHead = (unsigned*)(sq + p.sq_off.head);
+    r->sqTail = (unsigned*)(sq + p.sq_off.tail);
+    r->sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned*)(sq + p.sq_off.array);
+    r->cqHead = (unsigned*)(cq + p.cq_off.head);
+    r->cqTail = (unsigned*)(cq + p.cq_off.tail);
+    r->cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    //ask which opcodes exist so callers can fall back op by op on older kernels
+    size_t probeLen = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeLen);
+    if (probe == NULL){
+        uringExit(r);
+        return -1;
+    }
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0){
+        for (int i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++){
+            r->supported[i] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+        }
+    }
+    free(probe);
+    return 0;
+}
+
+/// @brief unmap the queues and close the ring
+/// @param r the ring to be released
+void uringExit(struct uring *r){
+    if (r->sqRing && r->sqRing != MAP_FAILED){
+        munmap(r->sqRing, r->sqRingSize);
+    }
+    if (r->cqRing && r->cqRing != MAP_FAILED){
+        munmap(r->cqRing, r->cqRingSize);
+    }
+    if (r->sqes && r->sqes != MAP_FAILED){
+        munmap(r->sqes, r->sqesSize);
+    }
+    if (r->fd >= 0){
+        close(r->fd);
+    }
+    r->fd = -1;
+}
+
+/// @brief check whether the running kernel implements opcode op
+/// @param r the ring
+/// @param op io_uring opcode
+/// @return non-zero if op can be submitted, 0 for every op once the ring broke
+int uringSupports(struct uring *r, int op){
+    return !r->broken && op >= 0 && op < IORING_OP_LAST && r->supported[op];
+}
+
+/// @brief register buf as fixed buffer 0 of the ring, so reads into it skip the
+///         per-request page pinning
+/// @param r the ring
+/// @param buf buffer to register
+/// @param len size of buf
+/// @return 0 on success, -1 on failure
+int uringRegisterBuffer(struct uring *r, void *buf, size_t len){
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0 ? -1 : 0;
+}
+
+/// @brief claim the next submission entry of the current batch
+/// @param r the ring
+/// @return a zeroed sqe whose user_data is its index in the batch, NULL if the batch is full
+struct io_uring_sqe *uringSqe(struct uring *r){
+    if (r->pending >= r->entries){
+        return NULL;
+    }
+    unsigned tail = *r->sqTail + r->pending;
+    unsigned idx = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = r->pending;
+    r->sqArray[idx] = idx;
+    r->pending++;
+    return sqe;
+}
+
+/// @brief submit the queued batch with one io_uring_enter and wait for all of it
+/// @param r the ring
+/// @param res res[i] receives the result of the i-th entry of the batch (-errno on failure,
+///            -ECANCELED for entries cut off by a broken link or never submitted)
+/// @return 0 on success, -1 if the ring itself failed before running any of the batch
+int uringRun(struct uring *r, int *res){
+    unsigned n = r->pending;
+    if (n == 0){
+        return 0;
+    }
+    __atomic_store_n(r->sqTail, *r->sqTail + n, __ATOMIC_RELEASE);
+    r->pending = 0;
+    unsigned done = 0;
+    unsigned submit = n;
+    int error = 0;
+    while (done < n - submit || (submit > 0 && error == 0)){
+        if (error == 0){
+            int rv = syscall(__NR_io_uring_enter, r->fd, submit, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (rv >= 0){
+                submit -= (unsigned)rv < submit ? (unsigned)rv : submit;
+            }else if (errno != EINTR && errno != EAGAIN && errno != EBUSY){
+                //entries the kernel took may still be running on our buffers: wait for them
+                //without entering again, and never use the ring after that
+                error = errno;
+                r->broken = 1;
+            }
+        }else{
+            sched_yield();
+        }
+        //reaping also frees the room EAGAIN and EBUSY wait for
+        unsigned head = *r->cqHead;
+        unsigned tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail){
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+            if (cqe->user_data < n){
+                res[cqe->user_data] = cqe->res;
+            }
+            head++;
+            done++;
+        }
+        __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+    }
+    if (submit == n && error){
+        errno = error;
+        return -1;
+    }
+    for (unsigned i = n - submit; i < n; i++){
+        res[i] = -ECANCELED;    //left in the queue of a broken ring, never to run
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+/*
+	A minimal io_uring ring built directly on the io_uring_setup/enter/register
+	syscalls, so the server does not depend on liburing being installed.
+*/
+
+#include <linux/io_uring.h>
+
+/// @brief one submission/completion ring pair mapped into this process
+struct uring {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned entries;
+    unsigned pending;                               // sqes queued but not yet submitted
+    unsigned char supported[IORING_OP_LAST];        // opcodes the running kernel implements
+    int broken;                                     // io_uring_enter failed: callers fall back to syscalls
+};
+
+/// @brief set up a ring with room for entries submissions
+/// @return 0 on success, -1 if the kernel does not provide a usable io_uring
+int uringInit(struct uring *r, unsigned entries);
+
+/// @brief tear the ring down
+void uringExit(struct uring *r);
+
+/// @brief check whether the running kernel implements opcode op and the ring still works
+int uringSupports(struct uring *r, int op);
+
+/// @brief register buf as fixed buffer 0 of the ring (for the *_FIXED opcodes)
+/// @return 0 on success, -1 on failure
+int uringRegisterBuffer(struct uring *r, void *buf, size_t len);
+
+/// @brief claim the next submission entry, zeroed, tagged with user_data = index of
+///         the entry within the current batch
+struct io_uring_sqe *uringSqe(struct uring *r);
+
+/// @brief submit the queued batch with one io_uring_enter and wait for all of it to complete
+/// @param res res[i] receives the result of the i-th entry of the batch (-errno on failure)
+/// @return 0 on success, -1 if the ring itself failed before running any of the batch
+int uringRun(struct uring *r, int *res);
+
+#endif